@@ -0,0 +1,253 @@
+// Records of a TU which failed to compile, guessed from raw tokens of every
+// file it entered, so the file is still browsable.  No preprocessing, so both
+// branches of an #if are indexed, and calls in macros are missed.
+//
+// At file scope, name ( ... ) { is a definition, name ( ... ) ; or , is a
+// declaration if preceded by a type, and name ( elsewhere is a use.
+// struct name { is a definition and struct name a use.
+//
+// Records are marked kApproximate, and the joiner prefers kPrecise records
+// of the same file from TUs which did compile.
+class ApproximateIndexer : boost::noncopyable
+{
+ public:
+  ApproximateIndexer(const clang::SourceManager& sourceManager,
+                     const clang::LangOptions& langOpts, FileTable* fileTable)
+    : sourceManager_(sourceManager),
+      langOpts_(langOpts),
+      util_(sourceManager, langOpts),
+      fileTable_(fileTable)
+  {
+  }
+
+  // index each file entered by the TU once
+  void index()
+  {
+    std::unordered_set<int> indexed;
+    for (unsigned i = 0; i < sourceManager_.local_sloc_entry_size(); ++i)
+    {
+      const clang::SrcMgr::SLocEntry& entry = sourceManager_.getLocalSLocEntry(i);
+      if (!entry.isFile())
+        continue;
+      auto location = clang::SourceLocation::getFromRawEncoding(entry.getOffset());
+      clang::FileID fileId = sourceManager_.getFileID(location);
+      if (sourceManager_.getFileEntryForID(fileId) == nullptr)
+        continue;  // <built-in>
+      if (indexed.insert(fileTable_->id(fileId)).second)
+        index(fileId);
+    }
+  }
+
+  void save(Sink* sink, Stats* stats)
+  {
+    proto::CompilationUnit cu;
+    cu.set_main_file(util_.filePathOrDie(sourceManager_.getMainFileID()));
+    cu.set_tier(proto::kApproximate);
+    FileTable::Local cuFiles(*fileTable_);
+    // the joiner expects one define per name in a TU
+    std::unordered_set<string> defined;
+    for (auto& file : files_)
+    {
+      for (const auto& func : file.functions())
+      {
+        const proto::Symbol& sym = file.symbols(func.symbol());
+        if (func.usage() != proto::kDefine || !defined.insert(sym.name()).second)
+          continue;
+        proto::Function* define = cu.add_functions();
+        *define = func;
+        define->clear_symbol();
+        define->set_name(sym.name());
+        if (sym.has_storage_class())
+          define->set_storage_class(sym.storage_class());
+        cuFiles.localize(define->mutable_range());
+      }
+      std::string content;
+      {
+      Stats::Timer timer(&stats->serializeUs);
+      fileTable_->localize(&file);
+      content = file.SerializeAsString();
+      }
+      Stats::Timer timer(&stats->writeUs);
+      sink->writeOrDie("file:" + file.filename(), content);
+    }
+    cuFiles.save(&cu);
+    LOG_INFO << "approximate " << files_.size() << " files " << cu.functions_size() << " defines";
+    Stats::Timer timer(&stats->writeUs);
+    sink->writeOrDie("main:" + cu.main_file(), cu.SerializeAsString());
+  }
+
+ private:
+  struct Token
+  {
+    llvm::StringRef text;  // in the buffer of file
+    clang::SourceLocation location;
+    clang::tok::TokenKind kind;
+  };
+
+  void index(clang::FileID fileId)
+  {
+    std::vector<Token> tokens;
+    lex(fileId, &tokens);
+    files_.emplace_back();
+    proto::SourceFile* file = &files_.back();
+    file->set_filename(fileTable_->path(fileTable_->id(fileId)));
+    file->set_tier(proto::kApproximate);
+    // name and whether static, to index in symbols
+    std::map<std::pair<llvm::StringRef, bool>, int> symbols;
+    int braces = 0;
+    int parens = 0;
+    bool isStatic = false;  // in the current file scope declaration
+    bool inFunction = false;  // in a function body, not a struct or initializer
+    for (size_t i = 0; i < tokens.size(); ++i)
+    {
+      const Token& tok = tokens[i];
+      switch (tok.kind)
+      {
+        case clang::tok::l_brace:
+          if (braces++ == 0)
+            inFunction = i > 0 && tokens[i-1].kind == clang::tok::r_paren;
+          continue;
+        case clang::tok::r_brace: braces = std::max(0, braces - 1); break;
+        case clang::tok::l_paren: ++parens; continue;
+        case clang::tok::r_paren: parens = std::max(0, parens - 1); continue;
+        case clang::tok::semi: break;
+        case clang::tok::raw_identifier: break;
+        default: continue;
+      }
+      if (tok.kind != clang::tok::raw_identifier)
+      {
+        // end of a file scope declaration
+        if (braces == 0)
+          isStatic = false;
+        continue;
+      }
+      if (tok.text == "static")
+      {
+        isStatic |= braces == 0;
+        continue;
+      }
+      if ((tok.text == "struct" || tok.text == "union") && i + 1 < tokens.size()
+          && tokens[i+1].kind == clang::tok::raw_identifier)
+      {
+        const Token& name = tokens[++i];
+        bool define = i + 1 < tokens.size() && tokens[i+1].kind == clang::tok::l_brace;
+        proto::Struct* st = file->add_structs();
+        st->set_name(name.text.str());
+        st->set_usage(define ? proto::kDefine : proto::kUse);
+        setRange(name, define, st->mutable_range());
+        continue;
+      }
+      if (i + 1 >= tokens.size() || tokens[i+1].kind != clang::tok::l_paren || isKeyword(tok.text))
+        continue;
+      const bool member = i > 0 && (tokens[i-1].kind == clang::tok::period
+                                    || tokens[i-1].kind == clang::tok::arrow);
+      if (member)
+        continue;
+      const bool typed = i > 0 && (tokens[i-1].kind == clang::tok::raw_identifier
+                                   || tokens[i-1].kind == clang::tok::star);
+      proto::Usage usage = proto::kUse;
+      if (braces == 0 && parens == 0 && typed)
+      {
+        const clang::tok::TokenKind next = afterParens(tokens, i + 1);
+        if (next == clang::tok::l_brace)
+          usage = proto::kDefine;
+        else if (next == clang::tok::semi || next == clang::tok::comma)
+          usage = proto::kDeclare;
+        else
+          continue;
+      }
+      else if (braces == 0 || !inFunction)
+      {
+        continue;  // eg. EXPORT_SYMBOL(name); or DECLARE_BITMAP(name, 8); in a struct
+      }
+
+      auto key = std::make_pair(tok.text, isStatic && braces == 0);
+      auto it = symbols.find(key);
+      if (it == symbols.end())
+      {
+        it = symbols.insert(std::make_pair(key, file->symbols_size())).first;
+        proto::Symbol* sym = file->add_symbols();
+        sym->set_name(tok.text.str());
+        if (key.second)
+          sym->set_storage_class(proto::kStatic);
+      }
+      proto::Function* func = file->add_functions();
+      func->set_symbol(it->second);
+      func->set_usage(usage);
+      setRange(tok, usage == proto::kDefine, func->mutable_range());
+    }
+  }
+
+  // raw tokens of fileId, without preprocessing directives
+  void lex(clang::FileID fileId, std::vector<Token>* tokens) const
+  {
+    clang::Lexer lexer(fileId, sourceManager_.getBuffer(fileId), sourceManager_, langOpts_);
+    clang::Token tok;
+    bool directive = false;
+    while (true)
+    {
+      lexer.LexFromRawLexer(tok);
+      if (tok.is(clang::tok::eof))
+        break;
+      if (tok.isAtStartOfLine())
+        directive = tok.is(clang::tok::hash);
+      if (directive)
+        continue;
+      const char* data = sourceManager_.getCharacterData(tok.getLocation());
+      tokens->push_back(Token{ llvm::StringRef(data, tok.getLength()), tok.getLocation(), tok.getKind() });
+    }
+  }
+
+  // kind of the token following the parenthesized list at tokens[i], and
+  // __attribute__((...)) after it
+  static clang::tok::TokenKind afterParens(const std::vector<Token>& tokens, size_t i)
+  {
+    while (i < tokens.size())
+    {
+      assert(tokens[i].kind == clang::tok::l_paren);
+      int depth = 0;
+      for (; i < tokens.size(); ++i)
+      {
+        if (tokens[i].kind == clang::tok::l_paren)
+          ++depth;
+        else if (tokens[i].kind == clang::tok::r_paren && --depth == 0)
+          break;
+      }
+      if (++i >= tokens.size())
+        break;
+      if (tokens[i].kind == clang::tok::raw_identifier && tokens[i].text.startswith("__attribute")
+          && i + 1 < tokens.size() && tokens[i+1].kind == clang::tok::l_paren)
+      {
+        ++i;
+        continue;
+      }
+      return tokens[i].kind;
+    }
+    return clang::tok::eof;
+  }
+
+  static bool isKeyword(llvm::StringRef name)
+  {
+    return llvm::StringSwitch<bool>(name)
+        .Cases("if", "for", "while", "switch", "return", true)
+        .Cases("sizeof", "typeof", "__typeof__", "_Alignof", "__alignof__", true)
+        .Cases("asm", "__asm__", "__attribute__", "defined", "_Static_assert", true)
+        .Cases("case", "do", "else", true)
+        .Default(false);
+  }
+
+  void setRange(const Token& name, bool define, proto::Range* range)
+  {
+    util_.sourceLocationToLocation(name.location, range->mutable_begin());
+    util_.sourceLocationToLocation(name.location.getLocWithOffset(name.text.size()),
+                                   range->mutable_end());
+    if (define)
+      range->set_file(fileTable_->id(name.location));
+  }
+
+  const clang::SourceManager& sourceManager_;
+  const clang::LangOptions& langOpts_;
+  const Util util_;
+  FileTable* fileTable_;
+  std::vector<proto::SourceFile> files_;
+};
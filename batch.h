@@ -0,0 +1,418 @@
+// Index every translation unit of a compilation database in one process.
+//
+// Worker threads pull commands from a shared cursor and run one IndexAction
+// at a time, so LLVM startup, builtin headers and protobuf initialization are
+// paid once per batch instead of once per TU.  The cursor walks TUs longest
+// first by cost of the last batch, see schedule().
+//
+// With useFork(), the main thread instead forks a child per TU from the warm
+// process, so a crashing TU only fails itself, see forkWork().
+class BatchIndexer : boost::noncopyable
+{
+ public:
+  typedef BuiltinHeaders Headers;
+  typedef clang::tooling::CompileCommand Command;
+
+  BatchIndexer(const clang::tooling::CompilationDatabase& db, const Headers& headers)
+    : commands_(db.getAllCompileCommands()),
+      headers_(headers)
+  {
+    inputs_.reserve(commands_.size());
+    for (auto& command : commands_)
+    {
+      inputs_.push_back(absoluteInput(&command));
+    }
+  }
+
+  // Index TUs on top of PCHs of these common headers, see Preamble.
+  void usePreamble(const std::vector<string>& includes)
+  {
+    preamble_.reset(new Preamble(includes, commands_, inputs_));
+  }
+
+  // Record inputs and cost of every TU in the manifest, and if incremental,
+  // skip TUs whose inputs are unchanged since the last batch, see Manifest.
+  void useManifest(const string& path, bool incremental)
+  {
+    manifest_.reset(new Manifest(path, headers_));
+    incremental_ = incremental;
+  }
+
+  // Skip #include lookups which missed in the last batch, see StatCache.
+  void useStatCache(const string& path)
+  {
+    statCache_.reset(new StatCache(path));
+  }
+
+  // Index each TU in a child process, numThreads children at a time.
+  void useFork()
+  {
+    fork_ = true;
+  }
+
+  // Traverse the AST of a large TU with up to threads threads, see
+  // IndexConsumer::partition().
+  void splitTraversal(int threads)
+  {
+    traverseThreads_ = threads;
+  }
+
+  // Skip function bodies and record only definitions and declarations, a
+  // quick first pass whose outputs are overwritten by the next full batch.
+  // The manifest is not updated, so that batch reindexes every TU indexed
+  // by this one.
+  void declarationsOnly()
+  {
+    declarationsOnly_ = true;
+  }
+
+  // return number of failed TUs
+  int run(int numThreads)
+  {
+    muduo::Timestamp start(muduo::Timestamp::now());
+    if (preamble_)
+    {
+      LOG_INFO << "Building " << preamble_->size() << " preambles";
+      runThreads(numThreads, [this] { buildPreambles(); });
+      LOG_INFO << "Built preambles " << timeDifference(muduo::Timestamp::now(), start) << " sec";
+    }
+    schedule();
+    if (fork_)
+    {
+      LOG_INFO << "Indexing " << commands_.size() << " TUs with " << numThreads << " processes";
+      forkWork(numThreads);
+    }
+    else
+    {
+      LOG_INFO << "Indexing " << commands_.size() << " TUs with " << numThreads << " threads";
+      runThreads(numThreads, [this] { work(); });
+    }
+    LOG_INFO << "Indexed " << commands_.size() << " TUs, " << failed_.load() << " failed, "
+             << skipped_.load() << " unchanged, "
+             << timeDifference(muduo::Timestamp::now(), start) << " sec";
+    if (manifest_)
+    {
+      manifest_->save();
+    }
+    if (statCache_)
+    {
+      LOG_INFO << "StatCache hits " << statCache_->hits() << " misses " << statCache_->misses();
+      statCache_->save();
+    }
+    LOG_INFO << "HeaderCache hits " << cache_.hits() << " misses " << cache_.misses();
+    return failed_;
+  }
+
+ private:
+  static void runThreads(int numThreads, const std::function<void()>& func)
+  {
+    std::vector<std::thread> threads;
+    for (int i = 0; i < numThreads; ++i)
+    {
+      threads.emplace_back(func);
+    }
+    for (auto& thr : threads)
+    {
+      thr.join();
+    }
+  }
+
+  // The clang 3.5 driver checks inputs against the cwd of the process, not
+  // WorkingDir of the FileManager, so relative inputs are made absolute.
+  // Their .cindex names then include the build directory, and inputs of
+  // the same name in different directories don't collide.
+  //
+  // CompileCommand of clang 3.5 has no Filename, so the driver is asked
+  // once per command, return the last input or empty if none.
+  static string absoluteInput(Command* command)
+  {
+    string last;
+    for (size_t i : inputIndices(command->CommandLine))
+    {
+      string& input = command->CommandLine[i];
+      if (!llvm::sys::path::is_absolute(input))
+      {
+        llvm::SmallString<256> path(command->Directory);
+        llvm::sys::path::append(path, input);
+        input = path.str();
+      }
+      last = input;
+    }
+    return last;
+  }
+
+  // clang::FileManager is not thread safe, so every worker owns one and
+  // reuses it for consecutive TUs built in the same directory.
+  struct Files
+  {
+    explicit Files(StatCache* cache)
+      : statCache(cache)
+    {
+    }
+
+    clang::FileManager* get(const std::string& dir)
+    {
+      if (!files || dir != directory)
+      {
+        clang::FileSystemOptions options;
+        // resolve -I and input paths against the build directory without chdir()
+        options.WorkingDir = dir;
+        files = new clang::FileManager(options);
+        if (statCache)
+          files->addStatCache(statCache->lookup());
+        directory = dir;
+      }
+      return files.get();
+    }
+
+    StatCache* statCache;  // may be null
+    llvm::IntrusiveRefCntPtr<clang::FileManager> files;
+    std::string directory;
+  };
+
+  void buildPreambles()
+  {
+    Files files(statCache_.get());
+    size_t n = 0;
+    while ((n = nextPreamble_++) < preamble_->size())
+    {
+      preamble_->build(n, files.get(preamble_->directory(n)), headers_, &cache_);
+    }
+  }
+
+  // Longest processing time first: a giant TU started last becomes the tail
+  // of the whole batch, started first it overlaps with many small ones.
+  // Workers take the next TU whenever they become idle, so a mispredicted
+  // cost is balanced by the remaining TUs.
+  //
+  // The cost of a TU is its wall time of last batch, or else the number of
+  // files it included then times the average time per included file.  New
+  // TUs are predicted to cost the average, and keep their relative order.
+  void schedule()
+  {
+    order_.resize(commands_.size());
+    for (size_t i = 0; i < order_.size(); ++i)
+    {
+      order_[i] = i;
+    }
+    if (!manifest_)
+      return;
+
+    std::vector<int64_t> wallMs(commands_.size(), -1);
+    std::vector<int> numInputs(commands_.size(), -1);
+    int64_t totalMs = 0, timedInputs = 0, timed = 0;
+    for (size_t i = 0; i < commands_.size(); ++i)
+    {
+      string output = IndexConsumerFactory::getOutput(inputFile(i));
+      if (manifest_->cost(output, &wallMs[i], &numInputs[i]) && wallMs[i] > 0)
+      {
+        totalMs += wallMs[i];
+        timedInputs += numInputs[i];
+        ++timed;
+      }
+    }
+    if (timed == 0)
+      return;
+
+    const double msPerInput = timedInputs > 0 ? static_cast<double>(totalMs) / timedInputs : 0;
+    const double averageMs = static_cast<double>(totalMs) / timed;
+    std::vector<double> costs(commands_.size());
+    for (size_t i = 0; i < commands_.size(); ++i)
+    {
+      if (wallMs[i] > 0)
+        costs[i] = wallMs[i];
+      else if (numInputs[i] > 0 && msPerInput > 0)
+        costs[i] = numInputs[i] * msPerInput;
+      else
+        costs[i] = averageMs;
+    }
+    std::stable_sort(order_.begin(), order_.end(), [&costs](size_t lhs, size_t rhs)
+                     { return costs[lhs] > costs[rhs]; });
+    LOG_INFO << "Scheduled " << timed << " of " << commands_.size() << " TUs by last cost, longest "
+             << costs[order_.front()] << " ms " << inputFile(order_.front());
+  }
+
+  void work()
+  {
+    Files files(statCache_.get());
+    size_t n = 0;
+    while ((n = next_++) < order_.size())
+    {
+      size_t index = order_[n];
+      if (skip(index))
+        continue;
+      muduo::Timestamp start(muduo::Timestamp::now());
+      bool succeed = indexOne(index, &files);
+      done(index, succeed, elapsedMs(start), 0);
+    }
+  }
+
+  static int64_t elapsedMs(muduo::Timestamp start)
+  {
+    return (muduo::Timestamp::now().microSecondsSinceEpoch() - start.microSecondsSinceEpoch()) / 1000;
+  }
+
+  // fork() is only safe in a single threaded process, so this runs in the
+  // main thread after all worker threads were joined.
+  void forkWork(size_t numProcs)
+  {
+    warmUp();
+    Files files(statCache_.get());
+    // pid to index of TU and its start time
+    std::map<pid_t, std::pair<size_t, muduo::Timestamp>> children;
+    size_t next = 0;
+    while (next < order_.size() || !children.empty())
+    {
+      while (next < order_.size() && children.size() < numProcs)
+      {
+        size_t n = order_[next++];
+        if (skip(n))
+          continue;
+        ::fflush(stdout);
+        pid_t pid = ::fork();
+        if (pid == 0)
+        {
+          bool succeed = indexOne(n, &files);
+          ::fflush(stdout);
+          ::_exit(succeed ? 0 : 1);
+        }
+        else if (pid < 0)
+        {
+          LOG_SYSERR << "fork " << inputFile(n);
+          done(n, false, 0, 0);
+        }
+        else
+        {
+          children[pid] = std::make_pair(n, muduo::Timestamp::now());
+        }
+      }
+
+      int status = 0;
+      struct rusage usage;
+      pid_t pid = ::wait4(-1, &status, 0, &usage);
+      if (pid < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        LOG_SYSERR << "wait4";
+        break;
+      }
+      auto it = children.find(pid);
+      if (it == children.end())
+        continue;
+      size_t n = it->second.first;
+      if (WIFSIGNALED(status))
+        LOG_ERROR << "Killed by signal " << WTERMSIG(status) << " " << inputFile(n);
+      done(n, WIFEXITED(status) && WEXITSTATUS(status) == 0,
+           elapsedMs(it->second.second), usage.ru_maxrss);
+      children.erase(it);
+    }
+  }
+
+  // Run clang once before forking, so every child shares the initialized
+  // targets, option and diagnostic tables and protobuf descriptors
+  // copy-on-write, instead of initializing them per TU.
+  void warmUp()
+  {
+    const char* kWarmUp = "/tmp/indexer-warmup.c";
+    std::vector<string> commands = { "clang", "-fsyntax-only", kWarmUp };
+    llvm::IntrusiveRefCntPtr<clang::FileManager> files(
+        new clang::FileManager(clang::FileSystemOptions()));
+    clang::tooling::ToolInvocation tool(commands, new clang::SyntaxOnlyAction, files.get());
+    tool.mapVirtualFile(kWarmUp, "#include <stddef.h>\nint main() { return 0; }\n");
+    for (const auto& it : headers_)
+    {
+      tool.mapVirtualFile(it.first, it.second);
+    }
+    tool.run();
+    proto::CompilationUnit::descriptor();
+  }
+
+  // true if index-th TU is unchanged since last batch
+  bool skip(size_t index)
+  {
+    if (!manifest_)
+      return false;
+    const clang::tooling::CompileCommand& command = commands_[index];
+    const std::string output = IndexConsumerFactory::getOutput(inputFile(index));
+    if (incremental_ && manifest_->upToDate(command, output))
+    {
+      LOG_DEBUG << "Unchanged " << inputFile(index);
+      ++skipped_;
+      return true;
+    }
+    manifest_->remove(output);
+    return false;
+  }
+
+  bool indexOne(size_t index, Files* files)
+  {
+    const clang::tooling::CompileCommand& command = commands_[index];
+    if (preamble_)
+    {
+      std::vector<std::string> commandLine = preamble_->commandLine(index, command);
+      if (!commandLine.empty())
+      {
+        if (runOne(commandLine, files->get(command.Directory)))
+          return true;
+        LOG_WARN << "Retry without preamble " << inputFile(index);
+      }
+    }
+    return runOne(command.CommandLine, files->get(command.Directory));
+  }
+
+  // maxRssKb is the peak memory of the child process, 0 if not forked
+  void done(size_t index, bool succeed, int64_t wallMs, int64_t maxRssKb)
+  {
+    const clang::tooling::CompileCommand& command = commands_[index];
+    if (!succeed)
+    {
+      LOG_ERROR << "Failed to index " << inputFile(index);
+      ++failed_;
+    }
+    else if (manifest_ && !declarationsOnly_)
+    {
+      string preamble = preamble_ ? preamble_->output(index) : string();
+      manifest_->update(command, IndexConsumerFactory::getOutput(inputFile(index)), preamble,
+                        wallMs, maxRssKb);
+    }
+  }
+
+  const string& inputFile(size_t index) const
+  {
+    return inputs_[index];
+  }
+
+  bool runOne(const std::vector<std::string>& commandLine, clang::FileManager* files)
+  {
+    std::vector<std::string> commands = commandLine;
+    commands.push_back("-fno-spell-checking");
+    clang::tooling::ToolInvocation tool(
+        commands, new IndexAction(&cache_, traverseThreads_, declarationsOnly_), files);
+    for (const auto& it : headers_)
+    {
+      tool.mapVirtualFile(it.first, it.second);
+    }
+    return tool.run();
+  }
+
+  std::vector<Command> commands_;
+  // input file of each command, absolute
+  std::vector<string> inputs_;
+  const Headers& headers_;
+  HeaderCache cache_;
+  std::unique_ptr<Preamble> preamble_;
+  std::unique_ptr<Manifest> manifest_;
+  // misses recorded by forked children are lost
+  std::unique_ptr<StatCache> statCache_;
+  // indices of commands_ in the order to index them
+  std::vector<size_t> order_;
+  std::atomic<size_t> next_{0};
+  std::atomic<size_t> nextPreamble_{0};
+  std::atomic<int> failed_{0};
+  std::atomic<int> skipped_{0};
+  bool incremental_ = false;
+  bool fork_ = false;
+  bool declarationsOnly_ = false;
+  int traverseThreads_ = 1;
+};
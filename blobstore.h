@@ -0,0 +1,82 @@
+// Content-addressed store of source files shared by all indexer runs of a
+// build, a blob is written once as blobs/<md5[0:2]>/<md5> and referenced by
+// its digest from "digests:" records.  Data derived from a blob, eg. its
+// proto::Syntax, is stored next to it as blobs/<md5[0:2]>/<md5><suffix>.
+class BlobStore : boost::noncopyable
+{
+ public:
+  static constexpr const char* kSyntaxSuffix = ".syntax";
+
+  explicit BlobStore(const string& dir = kBlobDir)
+    : dir_(dir)
+  {
+  }
+
+  bool contains(llvm::StringRef md5, llvm::StringRef suffix = "") const
+  {
+    struct stat st;
+    return ::stat(path(md5, suffix).c_str(), &st) == 0;
+  }
+
+  bool get(llvm::StringRef md5, string* content, llvm::StringRef suffix = "") const
+  {
+    FILE* fp = ::fopen(path(md5, suffix).c_str(), "rb");
+    if (!fp)
+      return false;
+    content->clear();
+    char buf[64*1024];
+    size_t nr = 0;
+    while ((nr = ::fread(buf, 1, sizeof buf, fp)) > 0)
+    {
+      content->append(buf, nr);
+    }
+    bool ok = !::ferror(fp);
+    ::fclose(fp);
+    return ok;
+  }
+
+  // Concurrent indexers may put the same blob, write to a temp file and
+  // rename() it, so a reader never sees a partial blob.
+  bool put(llvm::StringRef md5, llvm::StringRef content, llvm::StringRef suffix = "") const
+  {
+    string dir = dir_ + "/" + md5.substr(0, 2).str();
+    ::mkdir(dir_.c_str(), 0755);
+    ::mkdir(dir.c_str(), 0755);
+    string tmp = dir + "/.tmp.XXXXXX";
+    int fd = ::mkstemp(&tmp[0]);
+    if (fd < 0)
+    {
+      LOG_SYSERR << "BlobStore mkstemp " << tmp;
+      return false;
+    }
+    // mkstemp() creates the file 0600, make it readable as fopen() would
+    ::fchmod(fd, 0644);
+    size_t written = 0;
+    while (written < content.size())
+    {
+      ssize_t nw = ::write(fd, content.data() + written, content.size() - written);
+      if (nw <= 0)
+        break;
+      written += nw;
+    }
+    ::close(fd);
+    if (written != content.size() || ::rename(tmp.c_str(), path(md5, suffix).c_str()) != 0)
+    {
+      LOG_SYSERR << "BlobStore put " << md5.str();
+      ::unlink(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+ private:
+  static constexpr const char* kBlobDir = "blobs";
+
+  string path(llvm::StringRef md5, llvm::StringRef suffix) const
+  {
+    assert(md5.size() == 32);
+    return dir_ + "/" + md5.substr(0, 2).str() + "/" + md5.str() + suffix.str();
+  }
+
+  const string dir_;
+};
@@ -0,0 +1,41 @@
+// Records of already indexed header instances, shared by all TUs of a batch.
+//
+// The key is the header digest plus the digest of its "prep:" record, which
+// lists every macro referenced in the header and where it was defined, plus
+// the digest of the bodies of macros expanded in it and of the target and
+// language options, so two instances with the same key were preprocessed to
+// the same tokens, and parsed the same way.  Headers whose records refer to
+// decls of other files are not kept, see Visitor::declaredElsewhere().
+// The value is the serialized "file:" record, empty if it had no records.
+class HeaderCache : boost::noncopyable
+{
+ public:
+  bool find(const string& key, string* record) const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = records_.find(key);
+    if (it != records_.end())
+    {
+      *record = it->second;
+      ++hits_;
+      return true;
+    }
+    ++misses_;
+    return false;
+  }
+
+  void insert(const string& key, const string& record)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    records_.insert(std::make_pair(key, record));
+  }
+
+  int hits() const { return hits_; }
+  int misses() const { return misses_; }
+
+ private:
+  mutable std::mutex mutex_;
+  std::unordered_map<string, string> records_;
+  mutable std::atomic<int> hits_{0};
+  mutable std::atomic<int> misses_{0};
+};
@@ -1,10 +1,13 @@
 #include "leveldb/db.h"
 #include "llvm/Support/MD5.h"
 #include "build/record.pb.h"
+#include <algorithm>
+#include <map>
 #include <memory>
 
 #include <boost/noncopyable.hpp>
 
+#include <inttypes.h>
 #include <stdio.h>
 
 using std::string;
@@ -47,12 +50,76 @@ void dumpdb(const char* key)
   }
 }
 
+// Sum "stats:" records of .cindex files, to see where indexing time goes.
+void dumpStats(int argc, char* argv[])
+{
+  indexer::proto::Stats total;
+  std::map<string, indexer::proto::Stats::Count> counts;
+  std::vector<std::pair<int64_t, string>> slowest;
+  int tus = 0, failed = 0;
+  for (int i = 0; i < argc; ++i)
+  {
+    Reader reader(argv[i]);
+    string key, value;
+    while (reader.read(&key, &value))
+    {
+      indexer::proto::Stats stats;
+      if (!leveldb::Slice(key).starts_with("stats:") || !stats.ParseFromString(value))
+        continue;
+      ++tus;
+      if (stats.failed())
+        ++failed;
+      total.set_parse_us(total.parse_us() + stats.parse_us());
+      total.set_traverse_us(total.traverse_us() + stats.traverse_us());
+      total.set_serialize_us(total.serialize_us() + stats.serialize_us());
+      total.set_write_us(total.write_us() + stats.write_us());
+      total.set_max_rss_kb(std::max(total.max_rss_kb(), stats.max_rss_kb()));
+      for (const auto& count : stats.counts())
+      {
+        auto& sum = counts[count.prefix()];
+        sum.set_records(sum.records() + count.records());
+        sum.set_bytes(sum.bytes() + count.bytes());
+      }
+      slowest.push_back(std::make_pair(stats.parse_us() + stats.traverse_us()
+                                       + stats.serialize_us() + stats.write_us(),
+                                       stats.main_file()));
+    }
+  }
+
+  const int64_t us = total.parse_us() + total.traverse_us() + total.serialize_us() + total.write_us();
+  const double percent = us > 0 ? 100.0 / us : 0;
+  printf("%d TUs, %d failed, %.3f sec, max RSS %" PRId64 " KiB\n",
+         tus, failed, us / 1e6, total.max_rss_kb());
+  printf("  parse     %12.3f sec %5.1f%%\n", total.parse_us() / 1e6, total.parse_us() * percent);
+  printf("  traverse  %12.3f sec %5.1f%%\n", total.traverse_us() / 1e6, total.traverse_us() * percent);
+  printf("  serialize %12.3f sec %5.1f%%\n", total.serialize_us() / 1e6, total.serialize_us() * percent);
+  printf("  write     %12.3f sec %5.1f%%\n", total.write_us() / 1e6, total.write_us() * percent);
+  for (const auto& it : counts)
+  {
+    printf("  %-10s %10d records %12" PRId64 " bytes\n",
+           it.first.c_str(), it.second.records(), it.second.bytes());
+  }
+
+  const size_t kSlowest = std::min<size_t>(10, slowest.size());
+  std::partial_sort(slowest.begin(), slowest.begin() + kSlowest, slowest.end(),
+                    std::greater<std::pair<int64_t, string>>());
+  for (size_t i = 0; i < kSlowest; ++i)
+  {
+    printf("%10.3f sec %s\n", slowest[i].first / 1e6, slowest[i].second.c_str());
+  }
+}
+
 int main(int argc, char* argv[])
 {
   if (argc == 1)
   {
     dumpdb(NULL);
   }
+  else if (strcmp(argv[1], "-stats") == 0)
+  {
+    // d.out -stats tmp/*.cindex
+    dumpStats(argc - 2, argv + 2);
+  }
   else
   {
     if (strchr(argv[1], ':'))
@@ -0,0 +1,36 @@
+#!/usr/bin/python
+
+# Turn clang builtin headers into a C++ table that indexer.cc compiles in.
+# $ ./embed.py $llvm/build-O2/lib/clang/3.5.2/include > build/builtin_headers.inc
+import os, sys
+
+
+def escape(content):
+    out = ['  "']
+    for ch in bytearray(content):
+        if ch == ord('\n'):
+            out.append('\\n"\n  "')
+        elif ch in (ord('"'), ord('\\'), ord('?')):  # '?' avoids trigraphs
+            out.append('\\' + chr(ch))
+        elif 32 <= ch < 127:
+            out.append(chr(ch))
+        else:
+            out.append('\\%03o' % ch)
+    out.append('"')
+    return ''.join(out)
+
+
+def main(path):
+    print('// Generated by embed.py from %s, DO NOT EDIT.' % path)
+    print('// Sorted by name, see getBuiltinHeaders() in indexer.cc')
+    for name in sorted(os.listdir(path)):
+        if not name.endswith('.h'):
+            continue
+        with open(os.path.join(path, name), 'rb') as f:
+            content = f.read()
+        print('{ "%s", %d,' % (name, len(content)))
+        print(escape(content) + ' },')
+
+
+if __name__ == '__main__':
+    main(sys.argv[1])
@@ -0,0 +1,329 @@
+// Canonical path of every file, so a header reached as ./include/a.h,
+// include/a.h, include/linux/../a.h or through a symbolic link is one file
+// downstream, instead of one "file:" record, blob and page per spelling.
+//
+// A name of a FileEntry is relative to the working directory of its
+// FileManager, see BatchIndexer::Files, it is resolved by realpath(3) there,
+// and then made relative to the one root of the process, the realpath of its
+// cwd, if it is inside.  So a header has one key in every TU, and files of
+// the same name in two build directories stay apart.  Names which don't
+// exist, eg. virtual builtin headers, are only normalized lexically.  Results
+// are memoized for the process, and shared by all TUs of a batch.
+class CanonicalPaths : boost::noncopyable
+{
+ public:
+  static const string& get(const clang::SourceManager& sourceManager,
+                           const clang::FileEntry* file)
+  {
+    clang::FileManager& files = sourceManager.getFileManager();
+    return instance().canonical(files.getFileSystemOptions().WorkingDir, file->getName());
+  }
+
+  // realpath of the process cwd, a relative canonical path is relative to it
+  static const string& root()
+  {
+    return instance().root_;
+  }
+
+ private:
+  static CanonicalPaths& instance()
+  {
+    static CanonicalPaths paths;
+    return paths;
+  }
+
+  CanonicalPaths()
+  {
+    char cwd[PATH_MAX];
+    if (::getcwd(cwd, sizeof cwd) != nullptr)
+      cwd_ = cwd;
+    root_ = cwd_;
+    if (char* real = ::realpath(cwd_.c_str(), nullptr))
+    {
+      root_ = real;
+      ::free(real);
+    }
+  }
+
+  const string& canonical(const string& workingDir, llvm::StringRef name)
+  {
+    string key = workingDir;
+    key.push_back('\0');
+    key.append(name.data(), name.size());
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = paths_.find(key);
+      if (it != paths_.end())
+        return it->second;
+    }
+    const string& dir = workingDir.empty() ? cwd_ : workingDir;
+    string path = llvm::sys::path::is_absolute(name) ? name.str() : dir + "/" + name.str();
+    string result;
+    if (char* real = ::realpath(path.c_str(), nullptr))
+    {
+      result = real;
+      ::free(real);
+      result = relative(result, root_);
+    }
+    else if (workingDir.empty())
+    {
+      result = normalize(name);
+    }
+    else
+    {
+      result = relative(normalize(path), root_);
+    }
+    std::lock_guard<std::mutex> lock(mutex_);
+    // node based, so the reference stays valid
+    return paths_.insert(std::make_pair(key, result)).first->second;
+  }
+
+  static string relative(const string& path, const string& root)
+  {
+    if (!root.empty() && path.size() > root.size() && path.compare(0, root.size(), root) == 0
+        && path[root.size()] == '/')
+      return path.substr(root.size() + 1);
+    return path;
+  }
+
+  // without "." and "dir/.." components, and duplicated '/'
+  static string normalize(llvm::StringRef name)
+  {
+    std::vector<llvm::StringRef> components;
+    llvm::SmallVector<llvm::StringRef, 16> parts;
+    name.split(parts, "/");
+    for (llvm::StringRef part : parts)
+    {
+      if (part.empty() || part == ".")
+        continue;
+      if (part == ".." && !components.empty() && components.back() != "..")
+        components.pop_back();
+      else
+        components.push_back(part);
+    }
+    string result = name.startswith("/") ? "/" : "";
+    for (size_t i = 0; i < components.size(); ++i)
+    {
+      if (i > 0)
+        result += '/';
+      result += components[i].str();
+    }
+    return result.empty() ? name.str() : result;
+  }
+
+  string cwd_;
+  // realpath of cwd_, the same for every TU
+  string root_;
+  std::mutex mutex_;
+  // key is working directory and name, separated by '\0', as a relative
+  // name is looked up in the working directory
+  std::unordered_map<string, string> paths_;
+};
+
+// Paths of files of one TU by small integer IDs, records refer to files by
+// ID instead of by path, and a path is looked up once per FileID instead of
+// once per location.
+//
+// Records are compared and reused byte by byte across TUs, see HeaderCache
+// and the joiner, so IDs of a TU never leave it: localize() rewrites them to
+// IDs of a table in the record itself, in order of first use.  The joiner
+// rewrites those to IDs of the global "files:" table.
+class FileTable : boost::noncopyable
+{
+ public:
+  explicit FileTable(const clang::SourceManager& sourceManager)
+    : sourceManager_(sourceManager)
+  {
+  }
+
+  int id(clang::FileID fileId)
+  {
+    if (frozen_)
+    {
+      auto it = byFileId_.find(fileId.getHashValue());
+      assert(it != byFileId_.end());
+      return it->second;
+    }
+    if (fileId == lastFileId_ && lastId_ >= 0)
+      return lastId_;
+    auto it = byFileId_.find(fileId.getHashValue());
+    if (it == byFileId_.end())
+    {
+      int id = 0;
+      if (fileId.isInvalid())
+        id = this->id(kInvalidFileName);
+      else if (const clang::FileEntry* fileEntry = sourceManager_.getFileEntryForID(fileId))
+        id = this->id(fileEntry);
+      else
+        id = this->id(kBuiltInFileName);
+      it = byFileId_.insert(std::make_pair(fileId.getHashValue(), id)).first;
+    }
+    lastFileId_ = fileId;
+    lastId_ = it->second;
+    return lastId_;
+  }
+
+  // of the file containing a file location
+  int id(clang::SourceLocation location)
+  {
+    if (location.isInvalid())
+      return id(kInvalidFileName);
+    assert(location.isFileID());
+    return id(sourceManager_.getFileID(location));
+  }
+
+  int id(const clang::FileEntry* file)
+  {
+    auto it = byEntry_.find(file);
+    if (it != byEntry_.end())
+      return it->second;
+    assert(!frozen_);
+    int id = this->id(CanonicalPaths::get(sourceManager_, file));
+    byEntry_[file] = id;
+    return id;
+  }
+
+  int id(llvm::StringRef path)
+  {
+    auto it = byPath_.find(path);
+    if (it != byPath_.end())
+      return it->second;
+    assert(!frozen_);
+    int id = static_cast<int>(paths_.size());
+    paths_.push_back(path.str());
+    byPath_[path] = id;
+    return id;
+  }
+
+  // Assigns IDs to every file of the parsed TU, and of the PCH it loaded,
+  // after which id() only reads and may be called by many threads, see
+  // IndexConsumer::traverse().
+  void freeze()
+  {
+    id(kInvalidFileName);
+    id(kBuiltInFileName);
+    for (unsigned i = 0; i < sourceManager_.local_sloc_entry_size(); ++i)
+    {
+      const clang::SrcMgr::SLocEntry& entry = sourceManager_.getLocalSLocEntry(i);
+      if (entry.isFile())
+      {
+        auto location = clang::SourceLocation::getFromRawEncoding(entry.getOffset());
+        id(sourceManager_.getFileID(location));
+      }
+    }
+    // eg. of a struct defined in the preamble, see Preamble
+    for (unsigned i = 0; i < sourceManager_.loaded_sloc_entry_size(); ++i)
+    {
+      bool invalid = false;
+      const clang::SrcMgr::SLocEntry& entry = sourceManager_.getLoadedSLocEntry(i, &invalid);
+      if (!invalid && entry.isFile())
+      {
+        auto location = clang::SourceLocation::getFromRawEncoding(entry.getOffset());
+        id(sourceManager_.getFileID(location));
+      }
+    }
+    byFileId_.insert(std::make_pair(clang::FileID().getHashValue(), id(kInvalidFileName)));
+    frozen_ = true;
+  }
+
+  const string& path(int id) const
+  {
+    return paths_[id];
+  }
+
+  // Rewrites IDs of this TU in one record to IDs of its own "files" table.
+  class Local : boost::noncopyable
+  {
+   public:
+    explicit Local(const FileTable& table)
+      : table_(table)
+    {
+    }
+
+    int id(int tuId)
+    {
+      auto it = ids_.find(tuId);
+      if (it != ids_.end())
+        return it->second;
+      int id = static_cast<int>(paths_.size());
+      ids_[tuId] = id;
+      paths_.push_back(tuId);
+      return id;
+    }
+
+    void localize(proto::Range* range)
+    {
+      if (range->has_file())
+        range->set_file(id(range->file()));
+    }
+
+    template<typename MSG>  // Function or Struct
+    void localizeRefs(MSG* msg)
+    {
+      localize(msg->mutable_range());
+      for (int i = 0; i < msg->ref_file_size(); ++i)
+      {
+        msg->set_ref_file(i, id(msg->ref_file(i)));
+      }
+    }
+
+    template<typename MSG>  // SourceFile, Preprocess or CompilationUnit
+    void save(MSG* msg) const
+    {
+      msg->clear_files();
+      for (int tuId : paths_)
+      {
+        msg->add_files(table_.path(tuId));
+      }
+    }
+
+   private:
+    const FileTable& table_;
+    std::unordered_map<int, int> ids_;
+    // IDs of this TU by local ID
+    std::vector<int> paths_;
+  };
+
+  void localize(proto::SourceFile* file) const
+  {
+    Local local(*this);
+    for (auto& func : *file->mutable_functions())
+    {
+      local.localizeRefs(&func);
+    }
+    for (auto& st : *file->mutable_structs())
+    {
+      local.localizeRefs(&st);
+    }
+    local.save(file);
+  }
+
+  void localize(proto::Preprocess* pp) const
+  {
+    Local local(*this);
+    for (auto& inc : *pp->mutable_includes())
+    {
+      if (inc.has_included_file())
+        inc.set_included_file(local.id(inc.included_file()));
+    }
+    for (auto& macro : *pp->mutable_macros())
+    {
+      if (macro.has_ref_file())
+        macro.set_ref_file(local.id(macro.ref_file()));
+    }
+    local.save(pp);
+  }
+
+  static constexpr const char* kBuiltInFileName = "<built-in>";
+  static constexpr const char* kInvalidFileName = "<invalid location>";
+
+ private:
+  const clang::SourceManager& sourceManager_;
+  std::unordered_map<unsigned, int> byFileId_;  // key is FileID
+  std::unordered_map<const clang::FileEntry*, int> byEntry_;
+  llvm::StringMap<int> byPath_;
+  std::vector<string> paths_;
+  clang::FileID lastFileId_;
+  int lastId_ = -1;
+  bool frozen_ = false;
+};
@@ -35,15 +35,25 @@ class CommonHeader
     db_.reset(db);
   }
 
-  void save(const std::set<string>& seen)
+  void save(const std::set<string>& seen, const std::vector<string>& preamble)
   {
-    auto common= merge(seen);
+    proto::CompilationUnit prev;
+    bool loaded = load(&prev);
+    auto common= merge(seen, loaded ? &prev : nullptr);
     std::cout << common.size() << " common headers\n";
     proto::CompilationUnit cu;
     for (const string& file : common)
     {
       cu.add_files(file);
     }
+    // common prefix of preambles, see IncludePPCallbacks::endPreamble()
+    for (size_t i = 0; i < preamble.size(); ++i)
+    {
+      if (loaded && (i >= static_cast<size_t>(prev.preamble_size()) || prev.preamble(i) != preamble[i]))
+        break;
+      cu.add_preamble(preamble[i]);
+    }
+    std::cout << cu.preamble_size() << " preamble headers\n";
     Sink sink(db_.get());
     sink.writeOrDie("inc:", cu.SerializeAsString());
   }
@@ -63,12 +73,11 @@ class CommonHeader
     }
   }
 
-  std::set<string> merge(const std::set<string>& seen)
+  std::set<string> merge(const std::set<string>& seen, const proto::CompilationUnit* prev)
   {
-    proto::CompilationUnit cu;
-
-    if (load(&cu))
+    if (prev)
     {
+      const proto::CompilationUnit& cu = *prev;
       std::set<string> common;
       /*
       if (cu.files().size() < seen.size() / 10)
@@ -272,6 +281,12 @@ class IncludePPCallbacks : public clang::PPCallbacks
                           StringRef SearchPath,
                           StringRef RelativePath,
                           const Module *Imported) override {
+    if (!inMainFile(HashLoc))
+      return;
+    if (!IsAngled || File == nullptr)
+      endPreamble();
+    if (!preambleDone_)
+      preamble_.push_back("<" + FileName.str() + ">");
   }
 
   /// \brief Callback invoked when the end of the main file is reached.
@@ -295,9 +310,14 @@ class IncludePPCallbacks : public clang::PPCallbacks
     {
       std::cout << file << "\n";
     }
+    std::cout << "\nPreamble:\n";
+    for (const string& inc : preamble_)
+    {
+      std::cout << inc << "\n";
+    }
     std::cout << "\n";
     CommonHeader ch;
-    ch.save(seen_files_);
+    ch.save(seen_files_, preamble_);
   }
 
 #if 0
@@ -415,6 +435,8 @@ class IncludePPCallbacks : public clang::PPCallbacks
   /// \brief Hook called whenever a macro definition is seen.
   virtual void MacroDefined(const Token &MacroNameTok,
                             const MacroDirective *MD) {
+    if (inMainFile(MacroNameTok.getLocation()))
+      endPreamble();
   }
 
   /// \brief Hook called whenever a macro \#undef is seen.
@@ -422,6 +444,8 @@ class IncludePPCallbacks : public clang::PPCallbacks
   /// MD is released immediately following this callback.
   virtual void MacroUndefined(const Token &MacroNameTok,
                               const MacroDirective *MD) {
+    if (inMainFile(MacroNameTok.getLocation()))
+      endPreamble();
   }
 
   /// \brief Hook called whenever the 'defined' operator is seen.
@@ -450,6 +474,8 @@ class IncludePPCallbacks : public clang::PPCallbacks
   // FIXME: better to pass in a list (or tree!) of Tokens.
   virtual void If(SourceLocation Loc, SourceRange ConditionRange,
                   ConditionValueKind ConditionValue) {
+    if (inMainFile(Loc))
+      endPreamble();
   }
 
   /// \brief Hook called whenever an \#elif is seen.
@@ -468,6 +494,8 @@ class IncludePPCallbacks : public clang::PPCallbacks
   /// \param MD The MacroDirective if the name was a macro, null otherwise.
   virtual void Ifdef(SourceLocation Loc, const Token &MacroNameTok,
                      const MacroDirective *MD) {
+    if (inMainFile(Loc))
+      endPreamble();
   }
 
   /// \brief Hook called whenever an \#ifndef is seen.
@@ -476,6 +504,8 @@ class IncludePPCallbacks : public clang::PPCallbacks
   /// \param MD The MacroDirective if the name was a macro, null otherwise.
   virtual void Ifndef(SourceLocation Loc, const Token &MacroNameTok,
                       const MacroDirective *MD) {
+    if (inMainFile(Loc))
+      endPreamble();
   }
 
   /// \brief Hook called whenever an \#else is seen.
@@ -490,12 +520,27 @@ class IncludePPCallbacks : public clang::PPCallbacks
   virtual void Endif(SourceLocation Loc, SourceLocation IfLoc) {
   }
 
+  bool inMainFile(SourceLocation loc) const
+  {
+    return loc.isFileID() && sourceManager_.getFileID(loc) == sourceManager_.getMainFileID();
+  }
+
+  // The preamble is the leading #include <...> of the main file, it ends at
+  // the first quoted #include or any #define, #undef or conditional, which
+  // could change what the following headers expand to.
+  void endPreamble()
+  {
+    preambleDone_ = true;
+  }
+
   clang::CompilerInstance& compiler_;
   const clang::Preprocessor& preprocessor_;
   clang::SourceManager& sourceManager_;
   int indent_ = 0;
   std::set<string> seen_files_;
   std::set<string> reenter_files_;
+  std::vector<string> preamble_;
+  bool preambleDone_ = false;
 };
 }  // namespace indexer
 
@@ -1,15 +1,25 @@
 #include "indexer.h"
 
 #include "clang/Basic/Version.h"
-#include "clang/Tooling/Tooling.h"
-#include "llvm/Support/FileSystem.h"
-#include "llvm/Support/Path.h"
 
-#include "muduo/base/FileUtil.h"
+namespace
+{
+struct BuiltinHeader
+{
+  const char* name;
+  size_t size;
+  const char* content;
+};
 
-std::map<std::string, std::string> getBuiltinHeaders(const char* path)
+// clang's builtin headers, embedded by embed.py at build time, sorted by name.
+const BuiltinHeader kBuiltinHeaders[] = {
+#include "build/builtin_headers.inc"
+};
+}
+
+indexer::BuiltinHeaders getBuiltinHeaders()
 {
-  std::map<std::string, std::string> headers;
+  indexer::BuiltinHeaders headers;
   // see Linux::AddClangSystemIncludeArgs() in clang/lib/Driver/ToolChains.cpp
   // SmallString<128> P("/usr/lib/clang");
   // llvm::sys::path::append(P, CLANG_VERSION_STRING, "include/");
@@ -17,44 +27,131 @@ std::map<std::string, std::string> getBuiltinHeaders(const char* path)
   inc += CLANG_VERSION_STRING;
   inc += "/include/";
 
-  std::error_code ec;
-  llvm::sys::fs::directory_iterator it(path, ec);
-  if (ec)
-    return headers;
-  for (llvm::sys::fs::directory_iterator end; it != end; it.increment(ec))
-  {
-    if (ec)
-      break;
-    if (llvm::sys::path::extension(it->path()) != ".h")
-      continue;
-    std::string header = (inc + llvm::sys::path::filename(it->path())).str();
+  headers.reserve(sizeof kBuiltinHeaders / sizeof kBuiltinHeaders[0]);
+  for (const BuiltinHeader& header : kBuiltinHeaders)
+  {
+    // mapVirtualFile() wraps content with MemoryBuffer::getMemBuffer(), no copy.
+    headers.push_back(std::make_pair(inc + header.name,
+                                     llvm::StringRef(header.content, header.size)));
+  }
+  return headers;
+}
+
+// common leading headers of all TUs, saved by inc.cc
+std::vector<std::string> loadPreamble()
+{
+  std::vector<std::string> preamble;
+  leveldb::DB* db;
+  leveldb::Options options;
+  leveldb::Status status = leveldb::DB::Open(options, "testdb", &db);
+  if (status.ok())
+  {
+    std::unique_ptr<leveldb::DB> own(db);
     std::string content;
-    if (muduo::FileUtil::readFile(it->path(), 10*1024*1024, &content) == 0)
+    indexer::proto::CompilationUnit cu;
+    if (db->Get(leveldb::ReadOptions(), "inc:", &content).ok() && cu.ParseFromString(content))
     {
-      // LOG_TRACE << "Add " << header << " " << content.size();
-      headers[header] = content;
+      preamble.assign(cu.preamble().begin(), cu.preamble().end());
     }
   }
-  return headers;
+  return preamble;
+}
+
+int batch(int argc, char* argv[], const indexer::BuiltinHeaders& headers)
+{
+  // a.out -batch <dir of compile_commands.json> [-j threads] [-pch] [-incremental] [-fork]
+  //       [-split threads] [-declarations]
+  if (argc < 3)
+  {
+    fprintf(stderr, "Usage: %s -batch build_dir [-j threads] [-pch] [-incremental] [-fork]"
+            " [-split threads] [-declarations]\n", argv[0]);
+    return -1;
+  }
+  int threads = std::thread::hardware_concurrency();
+  bool pch = false;
+  bool incremental = false;
+  bool forking = false;
+  bool declarations = false;
+  int split = 1;
+  for (int i = 3; i < argc; ++i)
+  {
+    if (strcmp(argv[i], "-j") == 0 && i+1 < argc)
+      threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-pch") == 0)
+      pch = true;
+    else if (strcmp(argv[i], "-incremental") == 0)
+      incremental = true;
+    else if (strcmp(argv[i], "-fork") == 0)
+      forking = true;
+    else if (strcmp(argv[i], "-split") == 0 && i+1 < argc)
+      split = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-declarations") == 0)
+      declarations = true;
+  }
+  if (threads <= 0)
+    threads = 1;
+
+  std::string error;
+  std::unique_ptr<clang::tooling::CompilationDatabase> db(
+      clang::tooling::CompilationDatabase::loadFromDirectory(argv[2], error));
+  if (!db)
+  {
+    LOG_ERROR << error;
+    return -1;
+  }
+  indexer::BatchIndexer indexer(*db, headers);
+  if (pch)
+  {
+    std::vector<std::string> preamble = loadPreamble();
+    if (preamble.empty())
+      LOG_WARN << "No preamble in inc:, run e.out first";
+    else
+      indexer.usePreamble(preamble);
+  }
+  // always keep the manifest, for the cost of each TU
+  indexer.useManifest("tmp/manifest", incremental);
+  indexer.useStatCache("tmp/statcache");
+  if (forking)
+  {
+    indexer.useFork();
+  }
+  if (declarations)
+  {
+    indexer.declarationsOnly();
+  }
+  // 1 by default, as workers already keep all cores busy
+  indexer.splitTraversal(split);
+  return indexer.run(threads) == 0 ? 0 : -1;
 }
 
 int main(int argc, char* argv[])
 {
+  auto headers = getBuiltinHeaders();
+  LOG_INFO << "Adding " << headers.size() << " clang builtin headers";
+  if (argc > 1 && strcmp(argv[1], "-batch") == 0)
+  {
+    int ret = batch(argc, argv, headers);
+    google::protobuf::ShutdownProtobufLibrary();
+    return ret;
+  }
+
   std::vector<std::string> commands;
   for (int i = 0; i < argc; ++i)
     commands.push_back(argv[i]);
   commands.push_back("-fno-spell-checking");
   llvm::IntrusiveRefCntPtr<clang::FileManager> files(
       new clang::FileManager(clang::FileSystemOptions()));
+  // shared by single TU runs of the same build tree
+  indexer::StatCache statCache("tmp/statcache");
+  files->addStatCache(statCache.lookup());
   clang::tooling::ToolInvocation tool(commands, new indexer::IndexAction, files.get());
-  auto headers = getBuiltinHeaders(LLVM_PATH "/build-O2/lib/clang/3.5.2/include");
-  LOG_INFO << "Adding " << headers.size() << " clang builtin headers";
   for (const auto& it : headers)
   {
     tool.mapVirtualFile(it.first, it.second);
   }
 
   bool succeed = tool.run();
+  statCache.save();
   google::protobuf::ShutdownProtobufLibrary();
   return succeed ? 0 : -1;
 }
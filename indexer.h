@@ -1,94 +1,175 @@
 #include "build/record.pb.h"
 
 #include "llvm/Support/Casting.h"
+#include "llvm/ADT/StringSwitch.h"
 #include "llvm/Support/MD5.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Option/Arg.h"
+#include "llvm/Option/ArgList.h"
+#include "llvm/Option/OptTable.h"
 
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
 #include "clang/AST/Mangle.h"
 #include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Basic/CharInfo.h"
+#include "clang/Basic/FileSystemStatCache.h"
+#include "clang/Basic/VirtualFileSystem.h"
+#include "clang/Driver/Options.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
+#include "clang/Frontend/FrontendActions.h"
+#include "clang/Frontend/MultiplexConsumer.h"
 #include "clang/Lex/PPCallbacks.h"
 #include "clang/Lex/Preprocessor.h"
 #include "clang/Rewrite/Core/Rewriter.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+
+#include "google/protobuf/arena.h"
 
 #include "leveldb/db.h"
 
+#include "muduo/base/FileUtil.h"
 #include "muduo/base/Logging.h"
+#include "muduo/base/Timestamp.h"
 
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 
 #include <boost/noncopyable.hpp>
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace indexer
 {
 using std::string;
 #include "sink.h"
+#include "blobstore.h"
+#include "intervals.h"
+#include "scanner.h"
+#include "cache.h"
+#include "statcache.h"
+#include "stats.h"
+#include "filetable.h"
+#include "linetable.h"
 #include "util.h"
 #include "preprocess.h"
+#include "approx.h"
+
+// What a Visitor indexes, chosen at compile time, so it walks only the parts
+// of the AST which may contain them, see Visitor::TraverseStmt().
+//
+// FullXref records definitions, declarations and uses of functions and
+// structs.  DefsOnly records definitions and declarations, they are reached
+// through decl contexts alone, for a TU parsed with function bodies skipped,
+// see IndexConsumerFactory.
+struct FullXref
+{
+  static const bool kUses = true;
+  static const proto::Tier kTier = proto::kPrecise;
+};
+
+struct DefsOnly
+{
+  static const bool kUses = false;
+  static const proto::Tier kTier = proto::kDeclarations;
+};
 
-class Visitor : public clang::RecursiveASTVisitor<Visitor>
+template<typename Profile>
+class Visitor : public clang::RecursiveASTVisitor<Visitor<Profile>>
 {
-  typedef clang::RecursiveASTVisitor<Visitor> base;
+  typedef clang::RecursiveASTVisitor<Visitor<Profile>> base;
   typedef clang::SourceLocation Location;
 public:
-  explicit Visitor(clang::ASTContext& context)
+  // contextMutex is shared by Visitors traversing one AST concurrently
+  Visitor(clang::ASTContext& context, FileTable* fileTable, std::mutex* contextMutex = nullptr)
     : context_(context),
       sourceManager_(context.getSourceManager()),
       langOpts_(context.getLangOpts()),
       mangle_(context.createMangleContext()),
-      util_(sourceManager_, langOpts_)
+      util_(sourceManager_, langOpts_),
+      fileTable_(fileTable),
+      contextMutex_(contextMutex),
+      cuFiles_(*fileTable)
   {
   }
 
   // bool shouldVisitImplicitCode() const { return true; }
 
-  bool VisitDecl(const clang::Decl* decl)
+  // filename to "file:" record of headers reused from HeaderCache,
+  // their top level decls are not traversed.
+  void reuse(std::map<std::string, std::string> records)
   {
-    // const clang::NamedDecl* nd = llvm::dyn_cast<clang::NamedDecl>(decl);
-    // printf("decl %p %s %s\n", decl, decl->getDeclKindName(),
-    //        nd ? nd->getNameAsString().c_str() : "");
-    return true;
+    reused_.swap(records);
   }
 
-  bool VisitFunctionDecl(const clang::FunctionDecl* decl)
+  const std::map<std::string, std::string>& reused() const
   {
-    assert(decl->getLocation().isValid());
-    addFunction(decl);
-    return true;
+    return reused_;
   }
 
-  bool VisitRecordDecl(const clang::RecordDecl* decl)
+  bool TraverseDecl(clang::Decl* decl)
   {
-    assert(decl->getLocation().isValid());
-    addStruct(decl);
-    return true;
+    // decls from a precompiled preamble were indexed by IndexPCHAction
+    if (decl && decl->isFromASTFile())
+    {
+      addPreambleDefine(decl);
+      return true;
+    }
+    if (decl && isReused(decl))
+      return true;
+    return base::TraverseDecl(decl);
   }
 
-  bool VisitRecordType(clang::RecordType* type)
+  // Uses are in statements, and in type locs, eg. struct foo in a cast or
+  // of a parameter.  Without them, neither is walked.
+  bool TraverseStmt(clang::Stmt* stmt)
   {
-    // printf("RecordType %p\n", type->getDecl());
-    return true;
+    return Profile::kUses ? base::TraverseStmt(stmt) : true;
   }
 
-  bool VisitRecordTypeLoc(clang::RecordTypeLoc tl)
+  bool TraverseTypeLoc(clang::TypeLoc typeloc)
   {
-    addStruct(tl.getDecl(), tl.getNameLoc());
+    return Profile::kUses ? base::TraverseTypeLoc(typeloc) : true;
+  }
+
+  // visit RecordTypeLoc only, not its RecordType as well
+  bool shouldWalkTypesOfTypeLocs() const { return false; }
+
+  bool VisitFunctionDecl(const clang::FunctionDecl* decl)
+  {
+    assert(decl->getLocation().isValid());
+    addFunction(decl);
     return true;
   }
 
-  bool VisitStmt(const clang::Stmt* stmt)
+  bool VisitRecordDecl(const clang::RecordDecl* decl)
   {
-    //printf("stmt \n");
+    assert(decl->getLocation().isValid());
+    addStruct(decl);
     return true;
   }
 
-  bool VisitExpr(const clang::Expr* expr)
+  bool VisitRecordTypeLoc(clang::RecordTypeLoc tl)
   {
-    // printf("expr %p\n", expr);
+    addStruct(tl.getDecl(), tl.getNameLoc());
     return true;
   }
 
@@ -114,55 +195,166 @@ public:
     return true;
   }
 
-  bool VisitType(const clang::Type* type)
+ public:
+  // Appends records of other, which traversed the top level decls following
+  // those of this, so records stay in the order of a serial traversal.
+  void merge(const Visitor& other)
   {
-    //printf("type \n");
-    return true;
+    for (const auto& it : other.files_)
+    {
+      const proto::SourceFile& from = *it.second;
+      // index of symbols of other to index of symbols of this
+      std::vector<int> indices(from.symbols_size());
+      auto symbols = other.symbols_.find(it.first);
+      if (symbols != other.symbols_.end())
+      {
+        // in order of first use, as a serial traversal would add them
+        std::vector<const SymbolKey*> keys(from.symbols_size());
+        for (const auto& sym : symbols->second)
+        {
+          keys[sym.second] = &sym.first;
+        }
+        for (int i = 0; i < from.symbols_size(); ++i)
+        {
+          indices[i] = symbol(it.first, *keys[i], [&from, i](proto::Symbol* to) {
+            *to = from.symbols(i);
+          });
+        }
+      }
+      proto::SourceFile* file = sourceFile(it.first);
+      for (const auto& func : from.functions())
+      {
+        proto::Function* to = file->add_functions();
+        *to = func;
+        to->set_symbol(indices[func.symbol()]);
+      }
+      file->mutable_structs()->MergeFrom(from.structs());
+    }
+    dependent_.insert(other.dependent_.begin(), other.dependent_.end());
   }
 
-  bool VisitTypeLoc(clang::TypeLoc typeloc)
+  // Index each top level decl as it is parsed, and when records on arena_
+  // exceed budget bytes, write them and free the arena.  Records of a file
+  // may then be written in several "file:" chunks, merged by the joiner.
+  void stream(Sink* sink, Stats* stats, size_t budget)
   {
-    //printf("typeloc \n");
-    return true;
+    complete_ = false;
+    sink_ = sink;
+    stats_ = stats;
+    budget_ = budget;
   }
 
- public:
-  void save(Sink* sink)
+  void traverse(clang::DeclGroupRef group)
   {
-    proto::CompilationUnit cu;
+    for (clang::Decl* decl : group)
+    {
+      TraverseDecl(decl);
+    }
+    // SpaceAllocated() walks all blocks of arena_
+    if (++numGroups_ % kGroupsPerCheck == 0 && arena_.SpaceAllocated() > budget_)
+    {
+      flush();
+    }
+  }
+
+  void save(Sink* sink, Stats* stats, HeaderCache* cache,
+            const std::map<std::string, std::string>& headerKeys)
+  {
+    proto::CompilationUnit& cu = cu_;
     cu.set_main_file(util_.filePathOrDie(sourceManager_.getMainFileID()));
+    if (Profile::kTier != proto::kPrecise)
+      cu.set_tier(Profile::kTier);
     for (const auto& it : files_)
     {
-      assert(it.first == it.second.filename());
+      const string& filename = fileTable_->path(it.first);
+      assert(filename == it.second->filename());
+      if (reused_.find(filename) != reused_.end())
+      {
+        LOG_DEBUG << "ignore records of reused " << filename;
+        continue;
+      }
+      std::string content = saveFile(sink, stats, it.second);
+      auto key = headerKeys.find(filename);
+      if (cache && key != headerKeys.end() && dependent_.count(it.first) == 0)
+      {
+        cache->insert(key->second, content);
+      }
+    }
+    for (const auto& it : reused_)
+    {
+      if (it.second.empty())
+        continue;
       std::string uri = "file:" + it.first;
-      sink->writeOrDie(uri, it.second.SerializeAsString());
-      for (const auto& func : it.second.functions())
       {
-        if (func.usage() == proto::kDefine)
-        {
-          // func.mutable_range().set_filename(it.first);
-          assert(func.range().filename() == it.first);
-          *cu.add_functions() = func;
-        }
+      Stats::Timer timer(&stats->writeUs);
+      sink->writeOrDie(uri, it.second);
       }
-      for (const auto& st : it.second.structs())
+      proto::SourceFile file;
+      if (file.ParseFromString(it.second))
+        addDefines(file, &cu, &cuFiles_);
+      else
+        assert(false && "SourceFile::Parse");
+    }
+    if (cache)
+    {
+      // remember headers without any records as well
+      for (const auto& key : headerKeys)
       {
-        // FIXME: add undefined structs
+        if (files_.find(fileTable_->id(key.first)) == files_.end()
+            && reused_.find(key.first) == reused_.end())
+          cache->insert(key.second, "");
       }
     }
+    cuFiles_.save(&cu);
     printf("CompilationUnit %d bytes %d public functions\n", cu.ByteSize(), cu.functions_size());
     // printf("%s\n", cu.DebugString().c_str());
     std::string uri = "main:" + cu.main_file();
-    sink->writeOrDie(uri, cu.SerializeAsString());
+    std::string content;
+    {
+    Stats::Timer timer(&stats->serializeUs);
+    content = cu.SerializeAsString();
+    }
+    Stats::Timer timer(&stats->writeUs);
+    sink->writeOrDie(uri, content);
   }
 
  private:
+  // Writes the "file:" record of file, and adds its defines to cu_.
+  std::string saveFile(Sink* sink, Stats* stats, proto::SourceFile* file)
+  {
+    std::string content;
+    {
+    Stats::Timer timer(&stats->serializeUs);
+    fileTable_->localize(file);
+    content = file->SerializeAsString();
+    }
+    {
+    Stats::Timer timer(&stats->writeUs);
+    sink->writeOrDie("file:" + file->filename(), content);
+    }
+    addDefines(*file, &cu_, &cuFiles_);
+    return content;
+  }
+
+  void flush()
+  {
+    LOG_DEBUG << "flush " << files_.size() << " files of " << arena_.SpaceAllocated() << " bytes";
+    for (const auto& it : files_)
+    {
+      saveFile(sink_, stats_, it.second);
+    }
+    files_.clear();
+    symbols_.clear();
+    arena_.Reset();
+  }
+
   std::string getMangledName(const clang::FunctionDecl* decl)
   {
     llvm::SmallString<512> buffer;
     llvm::raw_svector_ostream mangled_name(buffer);
     if (mangle_->shouldMangleDeclName(decl))
     {
+      auto lock = lockContext();
       mangle_->mangleName(decl, mangled_name);
       return mangled_name.str().str();
     }
@@ -173,32 +365,15 @@ public:
   void addFunction(const clang::FunctionDecl* decl, Location usage = Location())
   {
     assert(decl->getDeclName());
-    proto::Function func;
-    func.set_name(decl->getName().str());
+    proto::Usage kind = proto::kUse;
+    if (usage.isInvalid())
     {
-    string mangled = getMangledName(decl);
-    if (!mangled.empty())
-      func.set_mangled(mangled);
-    }
-    {
-    clang::QualType type = decl->getType();
-    clang::SplitQualType split = type.split();
-    func.set_signature(clang::QualType::getAsString(split));
-    }
-    Util::setStorageClass(decl->getStorageClass(), &func);
-
-    if (usage.isValid())
-    {
-      func.set_usage(proto::kUse);
-    }
-    else
-    {
-      // a declaration or definition
-      func.set_usage(decl->isThisDeclarationADefinition() ? proto::kDefine : proto::kDeclare);
+      // a declaration or definition, whose body may be skipped
+      kind = decl->isThisDeclarationADefinition() || decl->hasSkippedBody()
+             ? proto::kDefine : proto::kDeclare;
       addDecl(decl);
       usage = decl->getLocation();
     }
-    if (usage.isMacroID()) func.set_macro(true);
 
     if (!decl->isThisDeclarationADefinition())
     {
@@ -212,35 +387,107 @@ public:
     // if it's a define, record it anyways
     // if it's a usage, record it anyways
     // discard a declaration with no location
-    proto::Range range;
-    if (util_.setNameRange(func.name(), usage, &range) || func.usage() != proto::kDeclare)
+    const FunctionInfo& info = functionInfo(decl);
+    proto::Range* range = newRange();
+    int file = 0;
     {
-      clang::SourceLocation fileLoc = sourceManager_.getFileLoc(usage);
-      string file = util_.filePathOrDie(fileLoc);
-      if (func.usage() == proto::kDefine)
-        range.set_filename(file);
-      if (files_.find(file) == files_.end())
-        files_[file].set_filename(file);
+    auto lock = lockContext();
+    if (!util_.setNameRange(info.name, usage, range) && kind == proto::kDeclare)
+      return;
+    file = fileTable_->id(sourceManager_.getFileLoc(usage));
+    }
+    if (kind == proto::kDefine)
+      range->set_file(file);
+    if (dependent_.count(file) == 0
+        && (declaredElsewhere(decl, file) || declaredElsewhere(decl->getType(), file)))
+      dependent_.insert(file);
 
-      *func.mutable_range() = range;
-      *files_[file].add_functions() = func;
+    SymbolKey key(decl->getCanonicalDecl(), info.type, decl->getStorageClass());
+    int index = symbol(file, key, [&info, decl](proto::Symbol* sym) {
+      sym->set_name(info.name);
+      if (!info.mangled.empty())
+        sym->set_mangled(info.mangled);
+      sym->set_signature(info.signature);
+      Util::setStorageClass(decl->getStorageClass(), sym);
+    });
+    proto::Function* func = sourceFile(file)->add_functions();
+    func->set_symbol(index);
+    func->set_usage(kind);
+    if (usage.isMacroID()) func->set_macro(true);
+    func->unsafe_arena_set_allocated_range(range);
+  }
+
+  // Symbol data computed once per canonical decl, the AST is complete, so
+  // they don't change during traversal, except the signature, which differs
+  // among redeclarations, eg. int f(); int f(int);
+  struct FunctionInfo
+  {
+    string name;
+    string mangled;
+    string signature;
+    void* type = nullptr;  // QualType of signature
+  };
+
+  struct StructInfo
+  {
+    string name;
+    bool resolved = false;
+    bool defined = false;
+    int defFile = -1;  // ID in FileTable
+    int defLineno = -1;
+  };
+
+  const FunctionInfo& functionInfo(const clang::FunctionDecl* decl)
+  {
+    FunctionInfo& info = functions_[decl->getCanonicalDecl()];
+    if (info.name.empty())
+    {
+      info.name = decl->getName().str();
+      info.mangled = getMangledName(decl);
+    }
+    clang::QualType type = decl->getType();
+    if (info.type != type.getAsOpaquePtr())
+    {
+      info.type = type.getAsOpaquePtr();
+      info.signature = clang::QualType::getAsString(type.split());
+    }
+    return info;
+  }
+
+  const StructInfo& structInfo(const clang::RecordDecl* decl)
+  {
+    StructInfo& info = structs_[decl->getCanonicalDecl()];
+    if (!info.resolved)
+    {
+      // while streaming, a struct may be defined after its use
+      info.resolved = complete_;
+      info.name = decl->getName().str();
+      if (clang::RecordDecl* def = decl->getDefinition())
+      {
+        info.resolved = true;
+        // printf("found def for struct\n");
+        clang::SourceLocation defLoc = def->getLocation();
+        assert(defLoc.isValid());
+        auto lock = lockContext();
+        clang::SourceLocation fileLoc = sourceManager_.getFileLoc(defLoc);
+        info.defined = true;
+        info.defFile = fileTable_->id(fileLoc);
+        proto::Location line;
+        util_.sourceLocationToLocation(fileLoc, &line);
+        info.defLineno = line.lineno();
+      }
     }
+    return info;
   }
 
-  void setDefine(const clang::RecordDecl* decl, proto::Struct* st)
+  void setDefine(const StructInfo& info, proto::Struct* st)
   {
     assert(st->ref_file_size() == 0);
     assert(st->ref_lineno_size() == 0);
-    if (clang::RecordDecl* def = decl->getDefinition())
+    if (info.defined)
     {
-      // printf("found def for struct\n");
-      clang::SourceLocation defLoc = def->getLocation();
-      assert(defLoc.isValid());
-      clang::SourceLocation fileLoc = sourceManager_.getFileLoc(defLoc);
-      st->add_ref_file(util_.filePathOrDie(fileLoc));
-      proto::Location line;
-      util_.sourceLocationToLocation(fileLoc, &line);
-      st->add_ref_lineno(line.lineno());
+      st->add_ref_file(info.defFile);
+      st->add_ref_lineno(info.defLineno);
     }
   }
 
@@ -253,49 +500,242 @@ public:
       // typedef struct { int x, y; } point_t;
       return;
     }
-    proto::Struct st;
-    st.set_name(decl->getName().str());
+    proto::Usage kind = proto::kUse;
+    if (usage.isInvalid())
+    {
+      // a declaration or definition
+      kind = decl->isCompleteDefinition() ? proto::kDefine : proto::kDeclare;
+      addDecl(decl);
+      usage = decl->getLocation();
+    }
 
-    if (usage.isValid())
+    // if it's a define, record it anyways
+    // if it's a usage, record it anyways
+    // discard a declaration with no location
+    const StructInfo& info = structInfo(decl);
+    proto::Range* range = newRange();
+    int file = 0;
     {
-      st.set_usage(proto::kUse);
-      setDefine(decl, &st);
+    auto lock = lockContext();
+    if (!util_.setNameRange(info.name, usage, range) && kind == proto::kDeclare)
+      return;
+    file = fileTable_->id(sourceManager_.getFileLoc(usage));
     }
-    else
+    if (kind == proto::kDefine)
+      range->set_file(file);
+
+    proto::Struct* st = sourceFile(file)->add_structs();
+    st->set_name(info.name);
+    st->set_usage(kind);
+    if (kind == proto::kDefine)
     {
-      // a declaration or definition
-      if (decl->isCompleteDefinition())
       {
-        st.set_usage(proto::kDefine);
-        st.set_size(context_.getTypeSize(context_.getRecordType(decl))/8);
+      auto lock = lockContext();
+      st->set_size(context_.getTypeSize(context_.getRecordType(decl))/8);
       }
-      else
+      // the size depends on types of fields
+      for (const clang::FieldDecl* field : decl->fields())
       {
-        st.set_usage(proto::kDeclare);
-        setDefine(decl, &st);
+        if (dependent_.count(file) != 0)
+          break;
+        if (declaredElsewhere(field->getType(), file))
+          dependent_.insert(file);
       }
+    }
+    else
+    {
+      setDefine(info, st);
+      if (info.defined && info.defFile != file)
+        dependent_.insert(file);
+    }
+    if (usage.isMacroID()) st->set_macro(true);
+    st->unsafe_arena_set_allocated_range(range);
+  }
 
-      addDecl(decl);
-      usage = decl->getLocation();
+  // ASTContext memoizes type layouts, and may create types, on demand, and
+  // every lookup of SourceManager updates its caches, eg. the last FileID,
+  // so Visitors of one AST take turns to use either.
+  std::unique_lock<std::mutex> lockContext() const
+  {
+    return contextMutex_ ? std::unique_lock<std::mutex>(*contextMutex_)
+                         : std::unique_lock<std::mutex>();
+  }
+
+  // canonical decl, QualType of signature, and storage class
+  typedef std::tuple<const clang::FunctionDecl*, void*, int> SymbolKey;
+
+  // index of key in symbols of a file, fill(symbol) if it is new there
+  template<typename Fill>
+  int symbol(int fileId, const SymbolKey& key, Fill&& fill)
+  {
+    std::map<SymbolKey, int>& symbols = symbols_[fileId];
+    auto it = symbols.find(key);
+    if (it == symbols.end())
+    {
+      proto::SourceFile* file = sourceFile(fileId);
+      it = symbols.insert(std::make_pair(key, file->symbols_size())).first;
+      fill(file->add_symbols());
     }
-    if (usage.isMacroID()) st.set_macro(true);
+    return it->second;
+  }
 
-    // if it's a define, record it anyways
-    // if it's a usage, record it anyways
-    // discard a declaration with no location
+  // Records of a TU are built in place on arena_, and freed with the Visitor.
+  proto::SourceFile* sourceFile(int fileId)
+  {
+    proto::SourceFile*& file = files_[fileId];
+    if (file == nullptr)
+    {
+      file = google::protobuf::Arena::CreateMessage<proto::SourceFile>(&arena_);
+      file->set_filename(fileTable_->path(fileId));
+      if (Profile::kTier != proto::kPrecise)
+        file->set_tier(Profile::kTier);
+    }
+    return file;
+  }
+
+  // a range of a discarded declaration stays on arena_ until the end of TU
+  proto::Range* newRange()
+  {
+    return google::protobuf::Arena::CreateMessage<proto::Range>(&arena_);
+  }
+
+  // file is localized, see FileTable
+  void addDefines(const proto::SourceFile& file, proto::CompilationUnit* cu, FileTable::Local* cuFiles)
+  {
+    int fileId = -1;
+    for (const auto& func : file.functions())
+    {
+      if (func.usage() == proto::kDefine)
+      {
+        assert(file.files(func.range().file()) == file.filename());
+        if (fileId < 0)
+          fileId = cuFiles->id(fileTable_->id(file.filename()));
+        // main: records have no symbols
+        const proto::Symbol& sym = file.symbols(func.symbol());
+        proto::Function* define = cu->add_functions();
+        *define = func;
+        define->clear_symbol();
+        define->set_name(sym.name());
+        if (sym.has_mangled())
+          define->set_mangled(sym.mangled());
+        define->set_signature(sym.signature());
+        if (sym.has_storage_class())
+          define->set_storage_class(sym.storage_class());
+        define->mutable_range()->set_file(fileId);
+      }
+    }
+    for (const auto& st : file.structs())
+    {
+      // FIXME: add undefined structs
+    }
+  }
+
+  // The joiner resolves static functions within a CU, so those defined by
+  // preamble headers go into "main:" of every TU built on the PCH, as the
+  // records of their files do when the headers are parsed, see addDefines().
+  void addPreambleDefine(const clang::Decl* decl)
+  {
+    const auto* func = llvm::dyn_cast<clang::FunctionDecl>(decl);
+    if (func == nullptr || func->getStorageClass() != clang::SC_Static
+        || !func->isThisDeclarationADefinition() || !func->getDeclName())
+      return;
+    const FunctionInfo& info = functionInfo(func);
     proto::Range range;
-    if (util_.setNameRange(st.name(), usage, &range) || st.usage() != proto::kDeclare)
+    int file = 0;
     {
-      clang::SourceLocation fileLoc = sourceManager_.getFileLoc(usage);
-      string file = util_.filePathOrDie(fileLoc);
-      if (st.usage() == proto::kDefine)
-        range.set_filename(file);
-      if (files_.find(file) == files_.end())
-        files_[file].set_filename(file);
+    auto lock = lockContext();
+    if (!util_.setNameRange(info.name, func->getLocation(), &range))
+      return;
+    file = fileTable_->id(sourceManager_.getFileLoc(func->getLocation()));
+    }
+    proto::Function* define = cu_.add_functions();
+    define->set_name(info.name);
+    if (!info.mangled.empty())
+      define->set_mangled(info.mangled);
+    define->set_signature(info.signature);
+    Util::setStorageClass(func->getStorageClass(), define);
+    define->set_usage(proto::kDefine);
+    define->mutable_range()->Swap(&range);
+    define->mutable_range()->set_file(cuFiles_.id(file));
+  }
 
-      *st.mutable_range() = range;
-      *files_[file].add_structs() = st;
+  bool isReused(const clang::Decl* decl)
+  {
+    const clang::DeclContext* dc = decl->getDeclContext();
+    if (reused_.empty() || dc == nullptr || !dc->isTranslationUnit())
+      return false;
+    Location location = decl->getLocation();
+    if (location.isInvalid())
+      return false;
+    auto lock = lockContext();
+    clang::FileID fileId = sourceManager_.getFileID(sourceManager_.getFileLoc(location));
+    auto it = reusedFileIds_.find(fileId.getHashValue());
+    if (it == reusedFileIds_.end())
+    {
+      const clang::FileEntry* fileEntry = sourceManager_.getFileEntryForID(fileId);
+      bool reused = fileEntry
+          && reused_.find(CanonicalPaths::get(sourceManager_, fileEntry)) != reused_.end();
+      it = reusedFileIds_.insert(std::make_pair(fileId.getHashValue(), reused)).first;
     }
+    return it->second;
+  }
+
+  // A record of file which refers to a decl of another file, or to a type
+  // declared there, eg. u32 or a struct, may differ in a TU which declares
+  // it differently, so the records of file are not kept in HeaderCache.
+  bool declaredElsewhere(const clang::Decl* decl, int file)
+  {
+    Location location = decl->getLocation();
+    if (location.isInvalid())
+      return false;
+    auto lock = lockContext();
+    return fileTable_->id(sourceManager_.getFileLoc(location)) != file;
+  }
+
+  bool declaredElsewhere(clang::QualType type, int file)
+  {
+    const clang::Type* t = type.getTypePtrOrNull();
+    while (t != nullptr)
+    {
+      if (const auto* typedefType = llvm::dyn_cast<clang::TypedefType>(t))
+      {
+        const clang::TypedefNameDecl* decl = typedefType->getDecl();
+        if (declaredElsewhere(decl, file))
+          return true;
+        t = decl->getUnderlyingType().getTypePtrOrNull();
+      }
+      else if (const auto* tagType = llvm::dyn_cast<clang::TagType>(t))
+      {
+        return declaredElsewhere(tagType->getDecl(), file);
+      }
+      else if (const auto* prototype = llvm::dyn_cast<clang::FunctionProtoType>(t))
+      {
+        for (clang::QualType param : prototype->getParamTypes())
+        {
+          if (declaredElsewhere(param, file))
+            return true;
+        }
+        t = prototype->getReturnType().getTypePtrOrNull();
+      }
+      else if (const auto* function = llvm::dyn_cast<clang::FunctionType>(t))
+      {
+        t = function->getReturnType().getTypePtrOrNull();
+      }
+      else if (const auto* array = llvm::dyn_cast<clang::ArrayType>(t))
+      {
+        t = array->getElementType().getTypePtrOrNull();
+      }
+      else if (t->isSugared())
+      {
+        // eg. parentheses, struct foo of C, or an array parameter decayed
+        t = t->getLocallyUnqualifiedSingleStepDesugaredType().getTypePtrOrNull();
+      }
+      else
+      {
+        t = t->getPointeeType().getTypePtrOrNull();
+      }
+    }
+    return false;
   }
 
   void addDecl(const clang::NamedDecl* decl)
@@ -309,18 +749,51 @@ public:
   const clang::LangOptions& langOpts_;
   std::unique_ptr<clang::MangleContext> mangle_;
   const Util util_;
+  FileTable* fileTable_;
+  std::mutex* contextMutex_;  // may be null
   std::unordered_map<const clang::NamedDecl*, clang::Decl::Kind> decls_;
-  // map from filename to files
-  std::map<std::string, proto::SourceFile> files_;
+  // key is canonical decl
+  std::unordered_map<const clang::FunctionDecl*, FunctionInfo> functions_;
+  std::unordered_map<const clang::Decl*, StructInfo> structs_;
+  google::protobuf::Arena arena_;
+  // map from file ID to files, on arena_
+  std::map<int, proto::SourceFile*> files_;
+  // map from file ID to index of each symbol in files_
+  std::map<int, std::map<SymbolKey, int>> symbols_;
+  // map from filename to reused records
+  std::map<std::string, std::string> reused_;
+  // FileID to whether it is reused
+  std::unordered_map<unsigned, bool> reusedFileIds_;
+  // file IDs whose records refer to decls of other files, see declaredElsewhere()
+  std::unordered_set<int> dependent_;
+  // "main:" record, defines are added as files are saved
+  proto::CompilationUnit cu_;
+  FileTable::Local cuFiles_;
+  // false while streaming, see stream()
+  bool complete_ = true;
+  Sink* sink_ = nullptr;
+  Stats* stats_ = nullptr;
+  size_t budget_ = 0;
+  int numGroups_ = 0;
+  static const int kGroupsPerCheck = 256;
 };
 
+template<typename Profile>
 class IndexConsumer : public clang::ASTConsumer
 {
  public:
-  IndexConsumer(clang::CompilerInstance& compiler, Sink* sink)
+  IndexConsumer(clang::CompilerInstance& compiler, Sink* sink, Stats* stats,
+                FileTable* fileTable, const IndexPP* pp, HeaderCache* cache,
+                int traverseThreads, size_t memoryBudget)
     : preprocessor_(compiler.getPreprocessor()),
       sourceManager_(compiler.getSourceManager()),
-      sink_(sink)
+      sink_(sink),
+      stats_(stats),
+      fileTable_(fileTable),
+      pp_(pp),
+      cache_(cache),
+      traverseThreads_(traverseThreads),
+      memoryBudget_(memoryBudget)
   {
     LOG_DEBUG;
   }
@@ -330,47 +803,263 @@ class IndexConsumer : public clang::ASTConsumer
     LOG_DEBUG;
   }
 
+  // With a memory budget, top level decls are indexed while the rest of the
+  // TU is parsed.  Headers are not reused from HeaderCache, as their keys
+  // are known at the end of the main file only.
+  void Initialize(clang::ASTContext& context) override
+  {
+    if (memoryBudget_ > 0)
+    {
+      streaming_.reset(new Visitor<Profile>(context, fileTable_));
+      streaming_->stream(sink_, stats_, memoryBudget_);
+    }
+  }
+
+  bool HandleTopLevelDecl(clang::DeclGroupRef group) override
+  {
+    if (streaming_ && !preprocessor_.getDiagnostics().hasErrorOccurred())
+    {
+      Stats::Timer timer(&stats_->traverseUs);
+      streaming_->traverse(group);
+    }
+    return true;
+  }
+
   void HandleTranslationUnit(clang::ASTContext& context) override
   {
     LOG_INFO << "HandleTranslationUnit";
     assert(&sourceManager_ == &context.getSourceManager());
+    stats_->endParse();
+    const clang::FileEntry* mainFile = sourceManager_.getFileEntryForID(sourceManager_.getMainFileID());
+    string mainFileName = mainFile ? CanonicalPaths::get(sourceManager_, mainFile) : "";
     if (preprocessor_.getDiagnostics().hasErrorOccurred())
     {
-      LOG_ERROR << "stop";
+      LOG_ERROR << "stop, index approximately";
+      {
+      Stats::Timer timer(&stats_->traverseUs);
+      ApproximateIndexer approx(sourceManager_, context.getLangOpts(), fileTable_);
+      approx.index();
+      approx.save(sink_, stats_);
+      }
+      stats_->save(sink_, mainFileName, true);
       return;
     }
 
-    Visitor visitor(context);
-    visitor.TraverseDecl(context.getTranslationUnitDecl());
+    if (streaming_)
+    {
+      LOG_INFO << "HandleTranslationUnit done";
+      streaming_->save(sink_, stats_, nullptr, pp_->headerKeys());
+      stats_->save(sink_, mainFileName, false);
+      return;
+    }
+
+    std::vector<std::vector<clang::Decl*>> parts = partition(context);
+    std::mutex contextMutex;
+    Visitor<Profile> visitor(context, fileTable_, parts.empty() ? nullptr : &contextMutex);
+    if (cache_)
+    {
+      visitor.reuse(findReusable());
+    }
+    {
+    Stats::Timer timer(&stats_->traverseUs);
+    if (parts.empty())
+      visitor.TraverseDecl(context.getTranslationUnitDecl());
+    else
+      traverse(context, parts, &contextMutex, &visitor);
+    }
     LOG_INFO << "HandleTranslationUnit done";
-    visitor.save(sink_);
+    visitor.save(sink_, stats_, cache_, pp_->headerKeys());
+    stats_->save(sink_, mainFileName, false);
   }
 
  private:
+  std::map<std::string, std::string> findReusable() const
+  {
+    std::map<std::string, std::string> records;
+    std::string record;
+    for (const auto& it : pp_->headerKeys())
+    {
+      if (cache_->find(it.second, &record))
+      {
+        records[it.first] = record;
+      }
+    }
+    LOG_INFO << "reuse " << records.size() << " of " << pp_->headerKeys().size() << " headers";
+    return records;
+  }
+
+  // Top level decls of a large TU split into contiguous parts of about the
+  // same amount of source, one part per thread.  Empty if the TU is small,
+  // or if the AST may still change, ie. it reads decls from a PCH lazily.
+  std::vector<std::vector<clang::Decl*>> partition(clang::ASTContext& context) const
+  {
+    std::vector<std::vector<clang::Decl*>> parts;
+    if (traverseThreads_ <= 1 || context.getExternalSource() != nullptr)
+      return parts;
+
+    std::vector<clang::Decl*> decls;
+    std::vector<size_t> sizes;
+    size_t total = 0;
+    for (clang::Decl* decl : context.getTranslationUnitDecl()->decls())
+    {
+      // see RecursiveASTVisitor::TraverseDeclContextHelper()
+      if (llvm::isa<clang::BlockDecl>(decl) || llvm::isa<clang::CapturedDecl>(decl))
+        continue;
+      auto begin = sourceManager_.getDecomposedExpansionLoc(decl->getLocStart());
+      auto end = sourceManager_.getDecomposedExpansionLoc(decl->getLocEnd());
+      size_t size = begin.first == end.first && end.second > begin.second
+                    ? end.second - begin.second : 1;
+      decls.push_back(decl);
+      sizes.push_back(size);
+      total += size;
+    }
+    size_t numParts = std::min<size_t>(traverseThreads_, total / kMinBytesPerThread);
+    if (numParts <= 1)
+      return parts;
+
+    parts.resize(numParts);
+    size_t sum = 0;
+    for (size_t i = 0; i < decls.size(); ++i)
+    {
+      size_t n = std::min(numParts - 1, sum * numParts / total);
+      parts[n].push_back(decls[i]);
+      sum += sizes[i];
+    }
+    LOG_INFO << "traverse " << decls.size() << " decls of " << total << " bytes with "
+             << numParts << " threads";
+    return parts;
+  }
+
+  // The first part is traversed by visitor in this thread, the others by
+  // their own Visitors in new threads, then merged into visitor in order.
+  // After parsing, the AST is only read, except by ASTContext and
+  // SourceManager, see Visitor::lockContext(), and FileTable, which is
+  // frozen.  So only the walk of the AST runs in parallel.
+  void traverse(clang::ASTContext& context,
+                const std::vector<std::vector<clang::Decl*>>& parts,
+                std::mutex* contextMutex, Visitor<Profile>* visitor)
+  {
+    fileTable_->freeze();
+    std::vector<std::unique_ptr<Visitor<Profile>>> others;
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < parts.size(); ++i)
+    {
+      others.emplace_back(new Visitor<Profile>(context, fileTable_, contextMutex));
+      others.back()->reuse(visitor->reused());
+      Visitor<Profile>* other = others.back().get();
+      const std::vector<clang::Decl*>& part = parts[i];
+      threads.emplace_back([other, &part] {
+        for (clang::Decl* decl : part)
+          other->TraverseDecl(decl);
+      });
+    }
+    for (clang::Decl* decl : parts.front())
+    {
+      visitor->TraverseDecl(decl);
+    }
+    for (size_t i = 0; i < threads.size(); ++i)
+    {
+      threads[i].join();
+      visitor->merge(*others[i]);
+    }
+  }
+
+  // smaller parts are not worth a thread
+  static const size_t kMinBytesPerThread = 64 * 1024;
+
   const clang::Preprocessor& preprocessor_;
   clang::SourceManager& sourceManager_;
   Sink* sink_;
+  Stats* stats_;
+  FileTable* fileTable_;
+  const IndexPP* pp_;  // owned by preprocessor_
+  HeaderCache* cache_;  // may be null
+  const int traverseThreads_;
+  const size_t memoryBudget_;  // 0 for unlimited
+  std::unique_ptr<Visitor<Profile>> streaming_;
 };
 
-class IndexAction : public clang::ASTFrontendAction
+// Creates the callbacks and consumer of one TU, and owns its output.
+class IndexConsumerFactory : boost::noncopyable
 {
- protected:
-  clang::ASTConsumer *CreateASTConsumer(clang::CompilerInstance& compiler,
-                                        clang::StringRef inputFile) override
+ public:
+  // cache is shared by TUs of a batch, may be null
+  // if declarationsOnly, function bodies are skipped by the parser, and the
+  // TU is indexed with DefsOnly
+  IndexConsumerFactory(HeaderCache* cache, int traverseThreads, bool declarationsOnly)
+    : cache_(cache),
+      traverseThreads_(traverseThreads),
+      declarationsOnly_(declarationsOnly)
   {
-    LOG_INFO << "IndexAction ctor " << inputFile.str();
+  }
+
+  // inputs of a batch are absolute, see BatchIndexer::absoluteInputs()
+  static string getOutput(const string& input)
+  {
+     string out = input + ".cindex";
+     std::transform(out.begin(), out.end(), out.begin(),[](char ch)
+                    { return ch == '/' ? '_' : ch; });
+     return "tmp/" + out;  // FIXME: change to cindex/
+  }
+
+  // bytes of records kept per TU, from $INDEXER_BUDGET_MB, 0 for unlimited
+  static size_t memoryBudget()
+  {
+    static const size_t budget = [] {
+      const char* mb = ::getenv("INDEXER_BUDGET_MB");
+      return mb ? static_cast<size_t>(atoi(mb)) * 1024 * 1024 : 0;
+    }();
+    return budget;
+  }
+
+  clang::ASTConsumer* create(clang::CompilerInstance& compiler, clang::StringRef inputFile)
+  {
+    if (declarationsOnly_)
+    {
+      // read by ParseAST() after the consumer is created
+      compiler.getFrontendOpts().SkipFunctionBodies = true;
+    }
     sink_.reset(new Sink(getOutput(inputFile.str()).c_str()));
-    auto* pp = new IndexPP(compiler, sink_.get());
+    stats_.reset(new Stats);
+    fileTable_.reset(new FileTable(compiler.getSourceManager()));
+    auto* pp = new IndexPP(compiler, sink_.get(), stats_.get(), fileTable_.get());
     compiler.getPreprocessor().addPPCallbacks(pp);
-    return new IndexConsumer(compiler, sink_.get());
+    if (declarationsOnly_)
+      return new IndexConsumer<DefsOnly>(compiler, sink_.get(), stats_.get(), fileTable_.get(), pp,
+                                         cache_, traverseThreads_, memoryBudget());
+    return new IndexConsumer<FullXref>(compiler, sink_.get(), stats_.get(), fileTable_.get(), pp,
+                                       cache_, traverseThreads_, memoryBudget());
     //auto* consumer = new PrintConsumer(CI.getPreprocessor(), CI.getSourceManager(), CI.getLangOpts());
     //pp->setRewriter(consumer->getRewriter());
     //return consumer;
   }
 
+ private:
+  std::unique_ptr<Sink> sink_;
+  std::unique_ptr<Stats> stats_;
+  std::unique_ptr<FileTable> fileTable_;
+  HeaderCache* cache_;
+  const int traverseThreads_;
+  const bool declarationsOnly_;
+};
+
+class IndexAction : public clang::ASTFrontendAction
+{
+ protected:
+  clang::ASTConsumer *CreateASTConsumer(clang::CompilerInstance& compiler,
+                                        clang::StringRef inputFile) override
+  {
+    LOG_INFO << "IndexAction ctor " << inputFile.str();
+    return factory_.create(compiler, inputFile);
+  }
+
  public:
 
-  IndexAction()
+  // cache is shared by TUs of a batch, may be null
+  // a large TU is traversed by up to traverseThreads threads
+  explicit IndexAction(HeaderCache* cache = nullptr, int traverseThreads = 1,
+                       bool declarationsOnly = false)
+    : factory_(cache, traverseThreads, declarationsOnly)
   {
     LOG_INFO << "IndexAction ctor";
   }
@@ -381,15 +1070,64 @@ class IndexAction : public clang::ASTFrontendAction
   }
 
  private:
-  string getOutput(const string& input)
+  IndexConsumerFactory factory_;
+};
+
+// Writes a PCH of the preamble header, and indexes the headers in it,
+// so TUs using the PCH don't index them again.
+class IndexPCHAction : public clang::GeneratePCHAction
+{
+ protected:
+  clang::ASTConsumer *CreateASTConsumer(clang::CompilerInstance& compiler,
+                                        clang::StringRef inputFile) override
   {
-     string out = input + ".cindex";
-     std::transform(out.begin(), out.end(), out.begin(),[](char ch)
-                    { return ch == '/' ? '_' : ch; });
-     return "tmp/" + out;  // FIXME: change to cindex/
+    LOG_INFO << "IndexPCHAction " << inputFile.str();
+    clang::ASTConsumer* pch = clang::GeneratePCHAction::CreateASTConsumer(compiler, inputFile);
+    if (pch == nullptr)
+      return nullptr;
+    std::vector<clang::ASTConsumer*> consumers;
+    consumers.push_back(pch);
+    consumers.push_back(factory_.create(compiler, inputFile));
+    return new clang::MultiplexConsumer(consumers);
   }
 
-  std::unique_ptr<Sink> sink_;
+ public:
+  explicit IndexPCHAction(HeaderCache* cache = nullptr)
+    : factory_(cache, 1, false)
+  {
+  }
+
+ private:
+  IndexConsumerFactory factory_;
 };
 
+// virtual path to content of clang builtin headers
+typedef std::vector<std::pair<std::string, llvm::StringRef>> BuiltinHeaders;
+
+// Indices of input files in a compile command, parsed by the clang driver,
+// so values of options, eg. -o x.o, are never taken for inputs, whatever
+// the extension of the source.  commandLine[0] is the compiler.
+inline std::vector<size_t> inputIndices(const std::vector<std::string>& commandLine)
+{
+  std::vector<const char*> argv;
+  for (size_t i = 1; i < commandLine.size(); ++i)
+  {
+    argv.push_back(commandLine[i].c_str());
+  }
+  std::unique_ptr<llvm::opt::OptTable> options(clang::driver::createDriverOptTable());
+  unsigned missingIndex = 0, missingCount = 0;
+  std::unique_ptr<llvm::opt::InputArgList> args(
+      options->ParseArgs(argv.data(), argv.data() + argv.size(), missingIndex, missingCount));
+  std::vector<size_t> result;
+  for (const llvm::opt::Arg* arg : *args)
+  {
+    if (arg->getOption().getKind() == llvm::opt::Option::InputClass)
+      result.push_back(arg->getIndex() + 1);
+  }
+  return result;
+}
+
+#include "preamble.h"
+#include "manifest.h"
+#include "batch.h"
 }
@@ -0,0 +1,93 @@
+// Sorted, disjoint [begin, end) offset intervals of a file, delta encoded in
+// proto::Intervals as begin0, end0 - begin0, begin1 - end0, end1 - begin1, ...
+// so most deltas fit in one or two bytes of a packed varint.
+class IntervalWriter : boost::noncopyable
+{
+ public:
+  explicit IntervalWriter(proto::Intervals* intervals)
+    : intervals_(intervals)
+  {
+    assert(intervals_->deltas_size() == 0);
+  }
+
+  // intervals must be added in order, adjacent ones are merged
+  void add(uint32_t begin, uint32_t end)
+  {
+    assert(begin >= last_ && end >= begin);
+    if (begin == end)
+      return;
+    int size = intervals_->deltas_size();
+    if (size > 0 && begin == last_)
+    {
+      intervals_->set_deltas(size - 1, intervals_->deltas(size - 1) + end - begin);
+    }
+    else
+    {
+      intervals_->add_deltas(begin - last_);
+      intervals_->add_deltas(end - begin);
+    }
+    last_ = end;
+  }
+
+ private:
+  proto::Intervals* intervals_;
+  uint32_t last_ = 0;
+};
+
+// decodes intervals one at a time
+class IntervalReader
+{
+ public:
+  explicit IntervalReader(const proto::Intervals& intervals)
+    : intervals_(intervals)
+  {
+  }
+
+  bool next(uint32_t* begin, uint32_t* end)
+  {
+    if (index_ + 1 >= intervals_.deltas_size())
+      return false;
+    *begin = end_ + intervals_.deltas(index_);
+    *end = end_ = *begin + intervals_.deltas(index_ + 1);
+    index_ += 2;
+    return true;
+  }
+
+ private:
+  const proto::Intervals& intervals_;
+  int index_ = 0;
+  uint32_t end_ = 0;
+};
+
+// func(begin, end) for each interval, in order
+template<typename Func>
+void forEachInterval(const proto::Intervals& intervals, Func&& func)
+{
+  IntervalReader reader(intervals);
+  uint32_t begin = 0, end = 0;
+  while (reader.next(&begin, &end))
+  {
+    func(begin, end);
+  }
+}
+
+// offsets in both lhs and rhs, in one pass over both
+inline void intersectIntervals(const proto::Intervals& lhs, const proto::Intervals& rhs,
+                               proto::Intervals* result)
+{
+  proto::Intervals intersection;
+  IntervalWriter writer(&intersection);
+  IntervalReader left(lhs), right(rhs);
+  uint32_t lbegin = 0, lend = 0, rbegin = 0, rend = 0;
+  bool hasLeft = left.next(&lbegin, &lend);
+  bool hasRight = right.next(&rbegin, &rend);
+  while (hasLeft && hasRight)
+  {
+    writer.add(std::max(lbegin, rbegin), std::max(std::max(lbegin, rbegin), std::min(lend, rend)));
+    if (lend < rend)
+      hasLeft = left.next(&lbegin, &lend);
+    else
+      hasRight = right.next(&rbegin, &rend);
+  }
+  result->Swap(&intersection);
+}
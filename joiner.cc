@@ -10,12 +10,24 @@
 //#include <stdio.h>
 #include <iostream>
 #include <memory>
+#include <tuple>
+#include <unordered_map>
 #include <unordered_set>
 
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace indexer
 {
 using std::string;
 #include "sink.h"
+#include "blobstore.h"
+#include "intervals.h"
+#include "scanner.h"
 
 class Joiner
 {
@@ -62,25 +74,157 @@ class Joiner
   // key is function name
   typedef std::map<string, proto::Function> FunctionMap;
 
+  // 0 for the most precise tier, Tier values don't follow precision
+  static int rank(proto::Tier tier)
+  {
+    switch (tier)
+    {
+      case proto::kPrecise:
+        return 0;
+      case proto::kDeclarations:
+        return 1;
+      case proto::kApproximate:
+        return 2;
+    }
+    assert(false && "Tier");
+    return 2;
+  }
+
   void add(const char* file)
   {
     Entries entries;
+    // file: records written in several chunks, merged once all are read
+    std::map<string, std::vector<string>> chunks;
 
     Reader reader(file);
     string key, value;
     while (reader.read(&key, &value))
     {
-      assert(entries.find(key) == entries.end());
-      entries[key] = value;
+      auto it = entries.find(key);
+      if (it == entries.end())
+        entries[key] = value;
+      else if (leveldb::Slice(key).starts_with("file:"))
+      {
+        std::vector<string>& more = chunks[key];
+        if (more.empty())
+          more.push_back(std::move(it->second));
+        more.push_back(value);
+      }
+      else
+        assert(false && "duplicated key");
+    }
+    for (const auto& it : chunks)
+    {
+      entries[it.first] = mergeChunks(it.second);
     }
     std::cout << "add " << file
               << " " << entries.size() << " entries\n";
+    auto it = entries.lower_bound("main:");
+    if (it == entries.end() || !leveldb::Slice(it->first).starts_with("main:"))
+    {
+      // a TU with errors, maybe with file: records streamed before them
+      LOG_WARN << "Skip " << file << " without main:";
+      return;
+    }
     proto::CompilationUnit cu = getCompilationUnit(entries);
     string main = cu.main_file();
     assert(inputs_.find(main) == inputs_.end());
     inputs_[main] = std::move(entries);
   }
 
+  // "files" of a record merged from chunks, in order of first use,
+  // as FileTable::localize() numbers them.
+  struct MergedFiles
+  {
+    explicit MergedFiles(proto::SourceFile* file)
+      : file(file)
+    {
+    }
+
+    template<typename MSG>  // Function or Struct
+    void localize(const proto::SourceFile& chunk, MSG* msg)
+    {
+      if (msg->range().has_file())
+        msg->mutable_range()->set_file(id(chunk.files(msg->range().file())));
+      for (int i = 0; i < msg->ref_file_size(); ++i)
+      {
+        msg->set_ref_file(i, id(chunk.files(msg->ref_file(i))));
+      }
+    }
+
+    int id(const string& path)
+    {
+      auto it = ids.insert(std::make_pair(path, file->files_size())).first;
+      if (it->second == file->files_size())
+        file->add_files(path);
+      return it->second;
+    }
+
+    proto::SourceFile* file;
+    std::unordered_map<string, int> ids;
+  };
+
+  // A streaming indexer writes records of a file in chunks, each with its
+  // own "files" and "symbols" tables.  Merge them into one record whose
+  // tables are rebuilt in order of first use, so it is the same record an
+  // unstreamed run writes.
+  string mergeChunks(const std::vector<string>& chunks)
+  {
+    std::vector<proto::SourceFile> sources(chunks.size());
+    bool approximate = false;
+    for (size_t i = 0; i < chunks.size(); ++i)
+    {
+      CHECK(sources[i].ParseFromString(chunks[i]));
+      approximate |= sources[i].tier() == proto::kApproximate;
+    }
+    // a TU failed after streaming some chunks, its approximate records
+    // cover the whole file
+    auto skipped = [approximate](const proto::SourceFile& source) {
+      return approximate && source.tier() != proto::kApproximate;
+    };
+
+    proto::SourceFile merged;
+    merged.set_filename(sources.front().filename());
+    MergedFiles files(&merged);
+    // name, mangled, signature, storage class
+    typedef std::tuple<string, string, string, int> SymbolKey;
+    std::map<SymbolKey, int> symbols;
+    for (auto& source : sources)
+    {
+      if (skipped(source))
+        continue;
+      if (source.has_tier())
+        merged.set_tier(source.tier());
+      for (auto& func : *source.mutable_functions())
+      {
+        if (func.has_symbol())
+        {
+          const proto::Symbol& sym = source.symbols(func.symbol());
+          SymbolKey key(sym.name(), sym.mangled(), sym.signature(),
+                        sym.storage_class());
+          auto it = symbols.insert(std::make_pair(key, merged.symbols_size())).first;
+          if (it->second == merged.symbols_size())
+            *merged.add_symbols() = sym;
+          func.set_symbol(it->second);
+        }
+        files.localize(source, &func);
+        merged.add_functions()->Swap(&func);
+      }
+    }
+    // structs after all functions, as FileTable::localize() does
+    for (auto& source : sources)
+    {
+      if (skipped(source))
+        continue;
+      for (auto& st : *source.mutable_structs())
+      {
+        files.localize(source, &st);
+        merged.add_structs()->Swap(&st);
+      }
+    }
+    return merged.SerializeAsString();
+  }
+
   proto::CompilationUnit getCompilationUnit(const Entries& entries)
   {
     proto::CompilationUnit cu;
@@ -88,9 +232,95 @@ class Joiner
     assert(it != entries.end());
     assert(leveldb::Slice(it->first).starts_with("main:"));
     CHECK(cu.ParseFromString(it->second));
+    globalize(&cu);
     return cu;
   }
 
+  // Records refer to files by IDs of their own "files" table, see FileTable
+  // in filetable.h, rewrite them to IDs of the global "files:" table.
+  int fileId(const string& path)
+  {
+    auto it = fileIds_.find(path);
+    if (it == fileIds_.end())
+    {
+      it = fileIds_.insert(std::make_pair(path, static_cast<int>(files_.size()))).first;
+      files_.push_back(path);
+    }
+    return it->second;
+  }
+
+  std::vector<int> globalIds(const google::protobuf::RepeatedPtrField<string>& files)
+  {
+    std::vector<int> ids;
+    ids.reserve(files.size());
+    for (const string& path : files)
+    {
+      ids.push_back(fileId(path));
+    }
+    return ids;
+  }
+
+  template<typename MSG>  // Function or Struct
+  static void globalizeRefs(const std::vector<int>& ids, MSG* msg)
+  {
+    if (msg->range().has_file())
+      msg->mutable_range()->set_file(ids[msg->range().file()]);
+    for (int i = 0; i < msg->ref_file_size(); ++i)
+    {
+      msg->set_ref_file(i, ids[msg->ref_file(i)]);
+    }
+  }
+
+  void globalize(proto::CompilationUnit* cu)
+  {
+    std::vector<int> ids = globalIds(cu->files());
+    for (auto& func : *cu->mutable_functions())
+    {
+      globalizeRefs(ids, &func);
+    }
+    cu->clear_files();
+  }
+
+  void globalize(proto::SourceFile* file)
+  {
+    std::vector<int> ids = globalIds(file->files());
+    for (auto& func : *file->mutable_functions())
+    {
+      globalizeRefs(ids, &func);
+    }
+    for (auto& st : *file->mutable_structs())
+    {
+      globalizeRefs(ids, &st);
+    }
+    file->clear_files();
+  }
+
+  void globalize(proto::Preprocess* pp)
+  {
+    std::vector<int> ids = globalIds(pp->files());
+    for (auto& inc : *pp->mutable_includes())
+    {
+      if (inc.has_included_file())
+        inc.set_included_file(ids[inc.included_file()]);
+    }
+    for (auto& macro : *pp->mutable_macros())
+    {
+      if (macro.has_ref_file())
+        macro.set_ref_file(ids[macro.ref_file()]);
+    }
+    pp->clear_files();
+  }
+
+  // parse, globalize and serialize
+  template<typename MSG>
+  Entries::value_type globalized(const Entries::value_type& entry)
+  {
+    MSG msg;
+    CHECK(msg.ParseFromString(entry.second));
+    globalize(&msg);
+    return Entries::value_type(entry.first, msg.SerializeAsString());
+  }
+
   void resolve()
   {
     FunctionMap functions = getGlobalFunctions();
@@ -120,6 +350,8 @@ class Joiner
     LOG_INFO << "getGlobalFunctions";
     muduo::Timestamp start(muduo::Timestamp::now());
     FunctionMap functions;
+    // tier of each define in functions
+    std::unordered_map<string, proto::Tier> tiers;
     for (const auto& input : inputs_)
     {
       const Entries& entries = input.second;
@@ -131,10 +363,17 @@ class Joiner
           auto it = functions.find(func.name());
           if (it != functions.end())
           {
-            std::cout << "duplicate global function: " << func.name() << "\n"
-                     << "    THIS " << func.ShortDebugString() << "\n"
-                     << "    PREV " << it->second.ShortDebugString() << "\n";
+            proto::Tier prev = tiers[func.name()];
+            if (rank(cu.tier()) > rank(prev))
+              continue;  // keep the more precise define
+            if (cu.tier() == prev && prev != proto::kApproximate)
+            {
+              std::cout << "duplicate global function: " << func.name() << "\n"
+                       << "    THIS " << func.ShortDebugString() << "\n"
+                       << "    PREV " << it->second.ShortDebugString() << "\n";
+            }
           }
+          tiers[func.name()] = cu.tier();
           functions[func.name()] = func;
         }
       }
@@ -208,71 +447,83 @@ class Joiner
   {
     proto::SourceFile sourceFile;
     CHECK(sourceFile.ParseFromString(file->second));
+    globalize(&sourceFile);
     assert(file->first.substr(strlen("file:")) == sourceFile.filename());
+    // symbols declared or used in file, not only defined
+    std::vector<bool> referenced(sourceFile.symbols_size()), used(sourceFile.symbols_size());
+    for (const proto::Function& func : sourceFile.functions())
+    {
+      if (func.usage() != proto::kDefine)
+        referenced[func.symbol()] = true;
+      if (func.usage() == proto::kUse)
+        used[func.symbol()] = true;
+    }
     // for each function in file
-    for (proto::Function& func : *sourceFile.mutable_functions())
+    for (int i = 0; i < sourceFile.symbols_size(); ++i)
     {
-      if (func.usage() == proto::kDefine)
+      proto::Symbol& sym = *sourceFile.mutable_symbols(i);
+      if (!referenced[i])
       {
-        if (func.storage_class() == proto::kStatic)
+        if (sym.storage_class() == proto::kStatic)
         {
-          auto it = staticFunctions.find(func.name());
-          assert(it != staticFunctions.end());
+          auto it = staticFunctions.find(sym.name());
+          // approximate records may define it in both branches of an #if
+          assert(it != staticFunctions.end() || sourceFile.tier() == proto::kApproximate);
           // FIXME more asserts
         }
       }
       else
       {
         // use or declare
-        if (func.storage_class() == proto::kStatic)
+        if (sym.storage_class() == proto::kStatic)
         {
-          auto it = staticFunctions.find(func.name());
+          auto it = staticFunctions.find(sym.name());
           if (it != staticFunctions.end())
           {
             proto::Function& define = it->second;
-            foundDefine(&func, &define);
+            foundDefine(&sym, &define);
           }
           else
           {
-            std::cout << "undefined static function " << func.ShortDebugString()
+            std::cout << "undefined static function " << sym.ShortDebugString()
                       << " IN " << sourceFile.filename()
                       << " CU " << cu << "\n";
           }
-          it = globalFunctions.find(func.name());
+          it = globalFunctions.find(sym.name());
           if (it != globalFunctions.end())
           {
-            std::cout << "global function hidden by static: "<< func.name()
+            std::cout << "global function hidden by static: "<< sym.name()
                       << " IN " << sourceFile.filename()
                       << " CU " << cu << "\n"
                       << "    DEF " << it->second.ShortDebugString() << "\n"
-                      << "    USE " << func.ShortDebugString() << "\n";
+                      << "    USE " << sym.ShortDebugString() << "\n";
           }
         }
         else
         {
           // use of global function
-          auto it = staticFunctions.find(func.name());
+          auto it = staticFunctions.find(sym.name());
           if (it != staticFunctions.end())
           {
             // some functions are declared as extern but defined as static
             proto::Function& define = it->second;
-            foundDefine(&func, &define);
-            LOG_TRACE << func.name() << " was defined as static, but used as " << func.DebugString();
-            assert(globalFunctions.find(func.name()) == globalFunctions.end());
+            foundDefine(&sym, &define);
+            LOG_TRACE << sym.name() << " was defined as static, but used as " << sym.DebugString();
+            assert(globalFunctions.find(sym.name()) == globalFunctions.end());
           }
           else
           {
-            it = globalFunctions.find(func.name());
+            it = globalFunctions.find(sym.name());
             if (it != globalFunctions.end())
             {
               proto::Function& define = it->second;
-              foundDefine(&func, &define);
+              foundDefine(&sym, &define);
             }
-            else if (func.usage() == proto::kUse &&
-                     !leveldb::Slice(func.name()).starts_with("__compiletime_assert_"))  // KERNEL HACK
+            else if (used[i] &&
+                     !leveldb::Slice(sym.name()).starts_with("__compiletime_assert_"))  // KERNEL HACK
             {
-              LOG_TRACE << "Undefined function " << func.name() << " used in " << cu;
-              undefinedFunctions_[func.name()] = func.signature();
+              LOG_TRACE << "Undefined function " << sym.name() << " used in " << cu;
+              undefinedFunctions_[sym.name()] = sym.signature();
             }
           }
         }
@@ -283,12 +534,13 @@ class Joiner
     file->second = sourceFile.SerializeAsString();
   }
 
-  void foundDefine(proto::Function* func, proto::Function* define)
+  // for all uses and declarations of sym in its file
+  void foundDefine(proto::Symbol* sym, proto::Function* define)
   {
-    assert(func->ref_file_size() == 0);
-    assert(func->ref_lineno_size() == 0);
-    func->add_ref_file(define->range().filename());
-    func->add_ref_lineno(define->range().begin().lineno());
+    assert(sym->ref_file_size() == 0);
+    assert(sym->ref_lineno_size() == 0);
+    sym->add_ref_file(define->range().file());
+    sym->add_ref_lineno(define->range().begin().lineno());
   }
 
   void resolveStructs()
@@ -303,44 +555,58 @@ class Joiner
     Entries preprocess;
     Entries mains;
     // key is file name
-    std::map<std::string, MD5String> md5s;
+    std::map<std::string, string> md5s;
     LOG_INFO << "merging";
     muduo::Timestamp start(muduo::Timestamp::now());
     for (const auto& input : inputs_)
     {
       const Entries& entries = input.second;
+      // skipped lines of each file of this TU, and all files it entered
+      std::map<string, proto::Intervals> skipped;
+      std::vector<string> entered;
       for (const auto& entry : entries)
       {
         leveldb::Slice key(entry.first);
         if (key.starts_with("src:"))
         {
-          update(&sources, entry);
+          // inlined by an indexer which could not write the blob store
           key.remove_prefix(4); // "src:"
-          md5s[key.ToString()] = md5String(entry.second);
+          addSource(&sources, &md5s, key.ToString(), md5String(entry.second).str().str(),
+                    &entry.second);
         }
         else if (key.starts_with("file:"))
         {
-          update(&files, entry);
+          // globalized by crossReferenceFunctions()
+          updateFile(&files, entry);
         }
         else if (key.starts_with("prep:"))
         {
-          update(&preprocess, entry);
+          update(&preprocess, withoutSkipped(entry, &skipped));
         }
         else if (key.starts_with("main:"))
         {
-          update(&mains, entry);
+          update(&mains, globalized<proto::CompilationUnit>(entry));
         }
         else if (key.starts_with("digests:"))
         {
           proto::Digests digests;
           CHECK(digests.ParseFromString(entry.second));
-          // FIXME: verify digests
+          for (const auto& digest : digests.digests())
+          {
+            addSource(&sources, &md5s, digest.filename(), digest.md5(), nullptr);
+            entered.push_back(digest.filename());
+          }
+        }
+        else if (key.starts_with("stats:"))
+        {
+          // see d.out -stats
         }
         else
         {
           LOG_WARN << "Unknown uri " << entry.first;
         }
       }
+      intersectSkipped(entered, &skipped);
     }
     LOG_INFO << "merge took  "
              << timeDifference(muduo::Timestamp::now(), start) << " sec";
@@ -352,6 +618,8 @@ class Joiner
     for (const auto& it : sources)
     {
       sink.writeOrDie(it.first, it.second);
+      string filename = it.first.substr(4);  // "src:"
+      sink.writeOrDie("syntax:" + filename, syntax(md5s[filename], it.second));
     }
     for (const auto& it : files)
     {
@@ -359,16 +627,138 @@ class Joiner
     }
     for (const auto& it : preprocess)
     {
-      sink.writeOrDie(it.first, it.second);
+      sink.writeOrDie(it.first, withSkipped(it));
     }
     for (const auto& it : mains)
     {
       sink.writeOrDie(it.first, it.second);
     }
+    proto::FileTable table;
+    for (const string& path : files_)
+    {
+      table.add_files(path);
+    }
+    sink.writeOrDie("files:", table.SerializeAsString());
+    LOG_INFO << files_.size() << " files";
     LOG_INFO << "write took "
              << timeDifference(muduo::Timestamp::now(), start) << " sec";
   }
 
+  // Skipped lines differ by configuration of TUs, compare prep: records
+  // without them, and move them to skipped.
+  Entries::value_type withoutSkipped(const Entries::value_type& entry,
+                                     std::map<string, proto::Intervals>* skipped)
+  {
+    proto::Preprocess pp;
+    CHECK(pp.ParseFromString(entry.second));
+    globalize(&pp);
+    for (auto& decl : *pp.mutable_declarators())
+    {
+      if (decl.type() == proto::Declarator::SKIPPED)
+        (*skipped)[pp.filename()].Swap(decl.mutable_intervals());
+    }
+    pp.clear_declarators();
+    return Entries::value_type(entry.first, pp.SerializeAsString());
+  }
+
+  // A line is dead code if every TU which entered its file skipped it, so
+  // skipped lines are intersected over TUs, a TU that skipped nothing of a
+  // file leaves nothing of it.  One linear merge per file per TU.
+  void intersectSkipped(const std::vector<string>& entered,
+                        std::map<string, proto::Intervals>* skipped)
+  {
+    static const proto::Intervals kNone;
+    for (const string& filename : entered)
+    {
+      auto it = skipped->find(filename);
+      const proto::Intervals& tu = it != skipped->end() ? it->second : kNone;
+      auto dead = skipped_.find(filename);
+      if (dead == skipped_.end())
+        skipped_[filename] = tu;
+      else if (dead->second.deltas_size() > 0)
+        intersectIntervals(dead->second, tu, &dead->second);
+    }
+  }
+
+  string withSkipped(const Entries::value_type& entry) const
+  {
+    const string filename = entry.first.substr(5);  // "prep:"
+    auto dead = skipped_.find(filename);
+    if (dead == skipped_.end() || dead->second.deltas_size() == 0)
+      return entry.second;
+    proto::Preprocess pp;
+    if (!pp.ParseFromString(entry.second))
+      abort();
+    auto* decl = pp.add_declarators();
+    decl->set_type(proto::Declarator::SKIPPED);
+    *decl->mutable_intervals() = dead->second;
+    return pp.SerializeAsString();
+  }
+
+  // Sources are compared by digest, and the content is read from the blob
+  // store only once per file.
+  void addSource(Entries* sources, std::map<string, string>* md5s,
+                 const string& filename, const string& md5, const string* content)
+  {
+    auto it = md5s->find(filename);
+    if (it == md5s->end())
+    {
+      string& source = (*sources)["src:" + filename];
+      if (content)
+      {
+        source = *content;
+      }
+      else if (!blobs_.get(md5, &source))
+      {
+        // maybe inlined as "src:" of this input
+        LOG_WARN << "Missing blob " << md5 << " of " << filename;
+        sources->erase("src:" + filename);
+        return;
+      }
+      (*md5s)[filename] = md5;
+    }
+    else if (it->second != md5)
+    {
+      string uri = "src:" + filename;
+      if (changed_.insert(uri).second)
+      {
+        std::cout << "changed " << uri << "\n";
+      }
+    }
+  }
+
+  // serialized proto::Syntax, scanned by the indexer unless it inlined src:
+  string syntax(const string& md5, const string& source) const
+  {
+    string result;
+    if (!blobs_.get(md5, &result, BlobStore::kSyntaxSuffix))
+    {
+      proto::Syntax syntax;
+      SyntaxScanner(source).scan(&syntax);
+      result = syntax.SerializeAsString();
+    }
+    return result;
+  }
+
+  // Records of a file from a more precise tier replace those from less
+  // precise ones, eg. kDeclarations records of a quick first pass are
+  // upgraded by kPrecise records of the full pass.
+  void updateFile(Entries* entries, const Entries::value_type& entry)
+  {
+    auto it = entries->find(entry.first);
+    if (it != entries->end() && it->second != entry.second)
+    {
+      proto::SourceFile prev, file;
+      CHECK(prev.ParseFromString(it->second));
+      CHECK(file.ParseFromString(entry.second));
+      if (rank(file.tier()) < rank(prev.tier()))
+        it->second = entry.second;
+      if (file.tier() != prev.tier())
+        return;
+    }
+    update(entries, entry);
+  }
+
   void update(Entries* entries, const Entries::value_type& entry)
   {
     auto it = entries->find(entry.first);
@@ -405,12 +795,18 @@ class Joiner
   }
 
   std::unique_ptr<leveldb::DB> db_;
+  const BlobStore blobs_;
   // key is compilation unit name
   std::map<string, Entries> inputs_;
   // key is function name
   std::map<string, int> allStaticFunctions_;
   std::map<string, string> undefinedFunctions_;
   std::unordered_set<string> changed_;
+  // key is file name, lines skipped by all TUs, see intersectSkipped()
+  std::map<string, proto::Intervals> skipped_;
+  // paths by global file ID
+  std::vector<string> files_;
+  std::unordered_map<string, int> fileIds_;
   static constexpr const char* kSrcmd5 = "srcmd5:";
   static const string printChanged_;
 };
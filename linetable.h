@@ -0,0 +1,57 @@
+// Start offsets of lines of one file, to decode offsets into 1-based line
+// and column as SourceManager::getLineNumber() and getColumnNumber() do,
+// without scanning back to the start of line for every column.
+//
+// Line breaks are \n, \r, \r\n and \n\r, as in clang's ComputeLineNumbers().
+// Lookups are mostly in increasing order, so a cursor at the last line is
+// tried before a binary search.
+class LineTable
+{
+ public:
+  explicit LineTable(llvm::StringRef buffer)
+  {
+    starts_.push_back(0);
+    const char* begin = buffer.data();
+    const char* end = begin + buffer.size();
+    for (const char* p = begin; p < end; )
+    {
+      char ch = *p++;
+      if (ch == '\n' || ch == '\r')
+      {
+        if (p < end && (*p == '\n' || *p == '\r') && *p != ch)
+          ++p;
+        starts_.push_back(static_cast<unsigned>(p - begin));
+      }
+    }
+  }
+
+  // 1-based
+  unsigned line(unsigned offset)
+  {
+    if (!inLine(cursor_, offset))
+    {
+      if (inLine(cursor_ + 1, offset))
+        ++cursor_;
+      else
+        cursor_ = std::upper_bound(starts_.begin(), starts_.end(), offset) - starts_.begin() - 1;
+    }
+    return cursor_ + 1;
+  }
+
+  // 1-based, in bytes
+  unsigned column(unsigned offset, unsigned line) const
+  {
+    return offset - starts_[line - 1] + 1;
+  }
+
+ private:
+  bool inLine(size_t index, unsigned offset) const
+  {
+    return index < starts_.size()
+        && starts_[index] <= offset
+        && (index + 1 == starts_.size() || offset < starts_[index + 1]);
+  }
+
+  std::vector<unsigned> starts_;
+  size_t cursor_ = 0;
+};
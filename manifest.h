@@ -0,0 +1,211 @@
+// Inputs of every TU indexed by the last batch, so an incremental batch only
+// reindexes TUs whose command line or any input file changed, and keeps the
+// .cindex of the others.
+//
+// Inputs are the "digests:" record of each .cindex, an input is unchanged if
+// its mtime and size are, or else if its MD5 is.  Their names are canonical,
+// relative to CanonicalPaths::root(), not to the build directory.
+class Manifest : boost::noncopyable
+{
+ public:
+  typedef clang::tooling::CompileCommand Command;
+
+  Manifest(const string& path, const BuiltinHeaders& headers)
+    : path_(path)
+  {
+    for (const auto& header : headers)
+    {
+      virtualFiles_.insert(header.first);
+    }
+    string content;
+    proto::Manifest manifest;
+    if (muduo::FileUtil::readFile(path_, 1024*1024*1024, &content) == 0
+        && manifest.ParseFromString(content))
+    {
+      for (const auto& entry : manifest.entries())
+      {
+        entries_[entry.output()] = entry;
+      }
+      LOG_INFO << "Manifest " << entries_.size() << " TUs";
+    }
+  }
+
+  bool upToDate(const Command& command, const string& output) const
+  {
+    proto::Manifest::Entry entry;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = entries_.find(output);
+      if (it == entries_.end())
+        return false;
+      entry = it->second;
+    }
+    struct stat st;
+    if (entry.directory() != command.Directory
+        || static_cast<size_t>(entry.command_line_size()) != command.CommandLine.size()
+        || !std::equal(command.CommandLine.begin(), command.CommandLine.end(),
+                       entry.command_line().begin())
+        || ::stat(output.c_str(), &st) != 0)
+      return false;
+
+    for (const auto& input : entry.inputs())
+    {
+      string path = resolve(input.filename());
+      if (::stat(path.c_str(), &st) != 0)
+        return false;
+      if (st.st_mtime == input.mtime() && st.st_size == input.size())
+        continue;
+      string content;
+      if (muduo::FileUtil::readFile(path, 1024*1024*1024, &content) != 0
+          || md5String(content).str() != input.md5())
+      {
+        LOG_DEBUG << "Changed " << path;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Forget output before reindexing it, so a failed run is never up to date.
+  void remove(const string& output)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.erase(output);
+  }
+
+  // Cost of output's last successful run, false if never indexed.
+  // numInputs is the number of files it included.
+  bool cost(const string& output, int64_t* wallMs, int* numInputs) const
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(output);
+    if (it == entries_.end())
+      return false;
+    *wallMs = it->second.wall_ms();
+    *numInputs = it->second.inputs_size();
+    return true;
+  }
+
+  // Record inputs and cost of a successfully indexed TU, or nothing if an
+  // input can't be stat'ed, so it is reindexed by the next batch.  A TU
+  // built on a PCH doesn't enter the preamble headers, they are inputs of
+  // preambleOutput, which is empty without one, see Preamble::output().
+  void update(const Command& command, const string& output, const string& preambleOutput,
+              int64_t wallMs, int64_t maxRssKb)
+  {
+    proto::Manifest::Entry entry;
+    entry.set_output(output);
+    entry.set_wall_ms(wallMs);
+    if (maxRssKb > 0)
+      entry.set_max_rss_kb(maxRssKb);
+    entry.set_directory(command.Directory);
+    for (const string& arg : command.CommandLine)
+    {
+      entry.add_command_line(arg);
+    }
+
+    proto::Digests digests;
+    if (!readDigests(output, &digests))
+      return;  // TU had errors
+    if (!preambleOutput.empty() && !readDigests(preambleOutput, &digests))
+      return;
+
+    std::unordered_set<string> added;
+    for (const auto& digest : digests.digests())
+    {
+      if (isVirtual(digest.filename()) || !added.insert(digest.filename()).second)
+        continue;
+      struct stat st;
+      string path = resolve(digest.filename());
+      if (::stat(path.c_str(), &st) != 0)
+      {
+        // an entry missing an input would be up to date too easily
+        LOG_SYSERR << "Manifest skips " << output << ", input " << path;
+        return;
+      }
+      auto* input = entry.add_inputs();
+      input->set_filename(digest.filename());
+      input->set_md5(digest.md5());
+      input->set_mtime(st.st_mtime);
+      input->set_size(st.st_size);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_[output].Swap(&entry);
+  }
+
+  bool save() const
+  {
+    proto::Manifest manifest;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (const auto& it : entries_)
+      {
+        *manifest.add_entries() = it.second;
+      }
+    }
+    string tmp = path_ + ".tmp";
+    FILE* fp = ::fopen(tmp.c_str(), "wb");
+    if (fp == nullptr)
+    {
+      LOG_SYSERR << "Manifest " << tmp;
+      return false;
+    }
+    string content = manifest.SerializeAsString();
+    bool ok = ::fwrite(content.data(), 1, content.size(), fp) == content.size();
+    ok = (::fclose(fp) == 0) && ok;
+    if (!ok || ::rename(tmp.c_str(), path_.c_str()) != 0)
+    {
+      LOG_SYSERR << "Manifest save " << path_;
+      return false;
+    }
+    LOG_INFO << "Manifest saved " << manifest.entries_size() << " TUs";
+    return true;
+  }
+
+ private:
+  // appends the "digests:" record of output, false if it has none
+  static bool readDigests(const string& output, proto::Digests* digests)
+  {
+    Reader reader(output.c_str());
+    if (!reader.valid())
+    {
+      LOG_SYSERR << "Manifest " << output;
+      return false;
+    }
+    string key, value;
+    while (reader.read(&key, &value))
+    {
+      if (leveldb::Slice(key).starts_with("digests:"))
+      {
+        proto::Digests more;
+        if (!more.ParseFromString(value) || more.digests_size() == 0)
+          return false;
+        digests->MergeFrom(more);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // see CanonicalPaths
+  static string resolve(const string& filename)
+  {
+    const string& root = CanonicalPaths::root();
+    if (filename.empty() || filename[0] == '/' || root.empty())
+      return filename;
+    return root + "/" + filename;
+  }
+
+  // <built-in> and clang builtin headers, which have no file to stat
+  bool isVirtual(const string& filename) const
+  {
+    return (!filename.empty() && filename[0] == '<') || virtualFiles_.count(filename) != 0;
+  }
+
+  const string path_;
+  mutable std::mutex mutex_;
+  // key is output
+  std::map<string, proto::Manifest::Entry> entries_;
+  std::unordered_set<string> virtualFiles_;
+};
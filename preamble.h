@@ -0,0 +1,221 @@
+// Precompiled preamble for groups of TUs which share compile flags and
+// build directory.
+//
+// The preamble is the common prefix of #include <...> of all main files,
+// recorded by e.out under "inc:".  Every group of two or more TUs gets a
+// tmp/preamble-<n>.h and its PCH, built by IndexPCHAction which also indexes
+// the preamble headers, then the TUs of the group are indexed with
+// -include-pch, and their main files skip those headers by include guards.
+// A main file which doesn't start with those #includes, eg. it changed since
+// "inc:" was recorded, is indexed without the PCH.
+class Preamble : boost::noncopyable
+{
+ public:
+  typedef clang::tooling::CompileCommand Command;
+
+  // inputs are the input file of each command
+  Preamble(const std::vector<string>& includes, const std::vector<Command>& commands,
+           const std::vector<string>& inputs)
+    : includes_(includes),
+      inputs_(inputs),
+      groupOf_(commands.size(), -1)
+  {
+    char cwd[PATH_MAX];
+    if (::getcwd(cwd, sizeof cwd) == nullptr)
+    {
+      LOG_SYSERR << "getcwd";
+      return;
+    }
+    // relative -I and -include differ among build directories
+    std::map<std::pair<string, std::vector<string>>, std::vector<size_t>> groups;
+    for (size_t i = 0; i < commands.size(); ++i)
+    {
+      auto key = std::make_pair(commands[i].Directory, flags(commands[i].CommandLine, inputs[i]));
+      groups[key].push_back(i);
+    }
+    for (const auto& group : groups)
+    {
+      if (group.second.size() < 2)
+        continue;
+      Group g;
+      g.directory = group.first.first;
+      g.flags = group.first.second;
+      char name[64];
+      snprintf(name, sizeof name, "/tmp/preamble-%zu", groups_.size());
+      g.header = cwd + string(name) + ".h";
+      g.pch = cwd + string(name) + ".pch";
+      for (size_t i : group.second)
+      {
+        groupOf_[i] = groups_.size();
+      }
+      groups_.push_back(std::move(g));
+    }
+    LOG_INFO << "Preamble " << includes_.size() << " headers, "
+             << groups_.size() << " groups of " << commands.size() << " TUs";
+  }
+
+  size_t size() const { return groups_.size(); }
+
+  // Build n-th preamble, different n can be built concurrently.
+  bool build(size_t n, clang::FileManager* files, const BuiltinHeaders& headers, HeaderCache* cache)
+  {
+    Group& group = groups_[n];
+    if (!writeHeader(group.header))
+      return false;
+    std::vector<string> commands = group.flags;
+    commands.push_back("-fno-spell-checking");
+    commands.push_back("-x");
+    commands.push_back("c-header");
+    commands.push_back(group.header);
+    commands.push_back("-o");
+    commands.push_back(group.pch);
+    clang::tooling::ToolInvocation tool(commands, new IndexPCHAction(cache), files);
+    for (const auto& it : headers)
+    {
+      tool.mapVirtualFile(it.first, it.second);
+    }
+    group.built = tool.run();
+    LOG_INFO << "Preamble " << group.pch << (group.built ? " built" : " failed");
+    return group.built;
+  }
+
+  const string& directory(size_t n) const { return groups_[n].directory; }
+
+  // .cindex of the PCH of index-th TU, whose "digests:" lists the preamble
+  // headers, or empty if it is indexed without one.
+  string output(size_t index) const
+  {
+    int n = groupOf_[index];
+    if (n >= 0 && groups_[n].built && startsWithIncludes(index))
+      return IndexConsumerFactory::getOutput(groups_[n].header);
+    return string();
+  }
+
+  // Command line of index-th TU using its preamble, or empty if none.
+  std::vector<string> commandLine(size_t index, const Command& command) const
+  {
+    std::vector<string> commands;
+    int n = groupOf_[index];
+    if (n >= 0 && groups_[n].built && startsWithIncludes(index))
+    {
+      commands = command.CommandLine;
+      commands.insert(commands.begin() + 1, { "-include-pch", groups_[n].pch });
+    }
+    return commands;
+  }
+
+ private:
+  struct Group
+  {
+    string directory;
+    std::vector<string> flags;
+    string header;
+    string pch;
+    bool built = false;
+  };
+
+  bool writeHeader(const string& header) const
+  {
+    FILE* fp = ::fopen(header.c_str(), "w");
+    if (fp == nullptr)
+    {
+      LOG_SYSERR << "Preamble " << header;
+      return false;
+    }
+    for (const string& inc : includes_)
+    {
+      fprintf(fp, "#include %s\n", inc.c_str());
+    }
+    ::fclose(fp);
+    return true;
+  }
+
+  // command line without options specific to one TU
+  static std::vector<string> flags(const std::vector<string>& commandLine, const string& input)
+  {
+    std::vector<string> result;
+    for (size_t i = 0; i < commandLine.size(); ++i)
+    {
+      llvm::StringRef arg = commandLine[i];
+      if (arg == input)
+        continue;
+      if (arg == "-o" || arg == "-MF" || arg == "-MT" || arg == "-MQ")
+      {
+        ++i;
+        continue;
+      }
+      if (arg == "-c" || arg.startswith("-Wp,-M") || arg == "-MD" || arg == "-MMD")
+        continue;
+      // KERNEL HACK: differ in every TU, and the preamble doesn't use them
+      if (arg.startswith("-DKBUILD_BASENAME=") || arg.startswith("-DKBUILD_MODNAME="))
+        continue;
+      result.push_back(arg.str());
+    }
+    return result;
+  }
+
+  // true if the main file of index-th TU begins with includes_, in order,
+  // after blank lines and comments
+  bool startsWithIncludes(size_t index) const
+  {
+    const string& path = inputs_[index];
+    if (path.empty())
+      return false;
+    string content;
+    // the preamble is at the top, a larger file is read in part
+    int err = muduo::FileUtil::readFile(path, 256*1024, &content);
+    if (err != 0)
+    {
+      LOG_WARN << "Preamble can't read " << path;
+      return false;
+    }
+    llvm::StringRef rest = content;
+    for (const string& inc : includes_)
+    {
+      llvm::StringRef line = nextLine(&rest);
+      if (!line.startswith("#"))
+        return false;
+      line = line.substr(1).ltrim();
+      if (!line.startswith("include"))
+        return false;
+      line = line.substr(strlen("include")).ltrim();
+      if (!line.startswith(inc))
+        return false;
+      line = line.substr(inc.size()).ltrim();
+      if (!line.empty() && !line.startswith("//") && !line.startswith("/*"))
+        return false;
+    }
+    return true;
+  }
+
+  // next line which isn't blank or a comment, without leading spaces
+  static llvm::StringRef nextLine(llvm::StringRef* rest)
+  {
+    while (!rest->empty())
+    {
+      *rest = rest->ltrim();
+      if (rest->startswith("//"))
+      {
+        *rest = rest->split('\n').second;
+      }
+      else if (rest->startswith("/*"))
+      {
+        size_t end = rest->find("*/", 2);
+        *rest = end == llvm::StringRef::npos ? llvm::StringRef() : rest->substr(end + 2);
+      }
+      else
+      {
+        std::pair<llvm::StringRef, llvm::StringRef> split = rest->split('\n');
+        *rest = split.second;
+        return split.first.rtrim();
+      }
+    }
+    return llvm::StringRef();
+  }
+
+  const std::vector<string> includes_;
+  const std::vector<string>& inputs_;
+  std::vector<Group> groups_;
+  // index of group of each TU, -1 for none
+  std::vector<int> groupOf_;
+};
@@ -1,12 +1,15 @@
 class IndexPP : public clang::PPCallbacks
 {
  public:
-  IndexPP(clang::CompilerInstance& compiler, Sink* sink)
+  IndexPP(clang::CompilerInstance& compiler, Sink* sink, Stats* stats, FileTable* fileTable)
     : compiler_(compiler),
       preprocessor_(compiler.getPreprocessor()),
       sourceManager_(compiler.getSourceManager()),
       util_(sourceManager_, compiler.getLangOpts()),
-      sink_(sink)
+      sink_(sink),
+      stats_(stats),
+      fileTable_(fileTable),
+      options_(optionsString(compiler))
 
   {
     // printf("predefines:\n%s\n", preprocessor_.getPredefines().c_str());
@@ -28,7 +31,8 @@ class IndexPP : public clang::PPCallbacks
 
     if (reason == clang::PPCallbacks::EnterFile)
     {
-      std::string content;
+      ++inclusions_[fileTable_->id(sourceManager_.getFileID(location))];
+      llvm::StringRef content;
       if (getFileContent(location, &content))
       {
         auto it = files_.find(file_changed);
@@ -36,10 +40,9 @@ class IndexPP : public clang::PPCallbacks
         {
           // a new file
           files_[file_changed] = content;
-          clang::FileID fileId = sourceManager_.getFileID(location);
-          findComments(fileId);
         }
-        else if (it->second != content)
+        // a file entered again has the same buffer, unless it was changed
+        else if (it->second.data() != content.data() && it->second != content)
         {
           LOG_WARN << "File content changed " << file_changed;
         }
@@ -75,26 +78,15 @@ class IndexPP : public clang::PPCallbacks
     if (file == nullptr)
       return;
 
-    std::string currentFile = filePath(hashLoc);
-
-    bool invalid = true;
-    unsigned lineno = sourceManager_.getSpellingLineNumber(hashLoc, &invalid);
-    if (invalid)
-      return;
-
-    std::string includedFile = file ? file->getName() : filename.str();
-    LOG_TRACE << currentFile << ":" << lineno << " -> " << includedFile;
-    Inclusions& inc = inclusions_[currentFile];
-
-    proto::Range range;
-    bool isMacro = filenameRange.getBegin().isMacroID();
-    if (isMacro)
+    auto hash = sourceManager_.getDecomposedLoc(hashLoc);
+    IncludeRecord inc = { hash.second, file, clang::SourceLocation(), clang::SourceLocation(),
+                          filenameRange.getBegin().isMacroID() };
+    if (inc.isMacro)
     {
-      LOG_WARN << currentFile << ":" << lineno << "#include " << filename.str() << " was a macro";
-      auto start = includeTok.getLocation();
-      auto end = start.getLocWithOffset(includeTok.getLength());
-      const clang::SourceRange srcRange(start, end);
-      sourceRangeToRange(srcRange, &range);
+      LOG_WARN << filePath(hash.first) << ":" << sourceManager_.getSpellingLineNumber(hashLoc)
+               << "#include " << filename.str() << " was a macro";
+      inc.begin = includeTok.getLocation();
+      inc.end = inc.begin.getLocWithOffset(includeTok.getLength());
     }
     else
     {
@@ -102,85 +94,110 @@ class IndexPP : public clang::PPCallbacks
       clang::SourceLocation filenameStart = filenameRange.getBegin().getLocWithOffset(1);
       clang::SourceLocation filenameEnd = filenameRange.getEnd().getLocWithOffset(-1);
       int filenameLength = 0;
-      invalid = true;
+      bool invalid = true;
       const char* filenameStr = sourceManager_.getCharacterData(filenameStart, &invalid);
       if (!invalid
           && sourceManager_.isInSameSLocAddrSpace(filenameStart, filenameEnd, &filenameLength)
           && static_cast<size_t>(filenameLength) == filename.size()
           && filename == clang::StringRef(filenameStr, filenameLength))
       {
-        // LOG_INFO << "good";
-        const clang::SourceRange srcRange(filenameStart, filenameEnd);
-        sourceRangeToRange(srcRange, &range);
+        inc.begin = filenameStart;
+        inc.end = filenameEnd;
       }
       else
       {
         LOG_WARN << filename.str() << " != " << clang::StringRef(filenameStr, filenameLength).str();
       }
     }
-
-    if (!inc.add(lineno, includedFile, isMacro, &range))
-    {
-      LOG_WARN << "#include changed at " << currentFile << ":" << lineno << " -> " << includedFile;
-    }
+    records(hash.first).includes.push_back(inc);
   }
 
   void EndOfMainFile() override
   {
     std::string mainFile = filePath(sourceManager_.getMainFileID());
     LOG_INFO << __FUNCTION__ << " " << mainFile;
+    if (sink_ == nullptr)
+      return;
+
+    std::map<std::string, MD5String> md5s;
+    {
+    Stats::Timer timer(&stats_->writeUs);
+    saveSources(mainFile, &md5s);
+    }
     if (preprocessor_.getDiagnostics().hasErrorOccurred())
     {
+      // only sources, for records of ApproximateIndexer
       LOG_ERROR << "stop";
+      sink_ = nullptr;
       return;
     }
-    if (sink_ == nullptr)
-      return;
-
-    saveSources(mainFile);
 
+    std::unordered_map<int, FileRecords> records = mergeRecords();
+    std::unordered_map<int, proto::Intervals> skippedLines = mergeSkipped();
     std::string content;
-    proto::Preprocess pp;
     for (const auto& it : files_)
     {
       const std::string& filename = it.first;
       std::string uri = "prep:" + filename;
 
+      // on the same arena as its includes and macros, so they are not copied
+      proto::Preprocess& pp = *google::protobuf::Arena::CreateMessage<proto::Preprocess>(&arena_);
       // LOG_INFO << it.first << ":\n" << pp.DebugString();
-      pp.Clear();
       pp.set_filename(filename);
       bool hasContent = false;
 
-      auto inc = inclusions_.find(filename);
-      if (inc != inclusions_.end())
+      const int fileId = fileTable_->id(filename);
+      auto rec = records.find(fileId);
+      if (rec != records.end())
       {
         hasContent = true;
-        inc->second.fill(&pp);
+        fillIncludes(&rec->second, &pp);
+        fillMacros(&rec->second, &pp);
       }
 
-      auto macro = macros_.find(filename);
-      if (macro != macros_.end())
+      auto skipped = skippedLines.find(fileId);
+      if (skipped != skippedLines.end())
       {
         hasContent = true;
-        macro->second.fill(&pp);
+        proto::Declarator* declarator = pp.add_declarators();
+        declarator->set_type(proto::Declarator::SKIPPED);
+        declarator->mutable_intervals()->Swap(&skipped->second);
       }
 
-      if (!hasContent)
+      content.clear();
       {
-        continue;
+      Stats::Timer timer(&stats_->serializeUs);
+      fileTable_->localize(&pp);
+      if (hasContent && !pp.SerializeToString(&content))
+      {
+        assert(false && "Preprocess::Serialize");
       }
-      if (pp.SerializeToString(&content))
+      }
+      if (filename != mainFile)
       {
-        sink_->writeOrDie(uri, content);
+        // see HeaderCache
+        std::string& key = headerKeys_[filename];
+        key = md5s[filename].str().str();
+        key += md5String(content).str();
+        key += definitionsDigest(rec != records.end() ? &rec->second : nullptr);
       }
-      else
+
+      if (!hasContent)
       {
-        assert(false && "Preprocess::Serialize");
+        continue;
       }
+      Stats::Timer timer(&stats_->writeUs);
+      sink_->writeOrDie(uri, content);
     }
     sink_ = nullptr;
   }
 
+  // filename to HeaderCache key of every header, valid after EndOfMainFile()
+  const std::map<std::string, std::string>& headerKeys() const
+  {
+    return headerKeys_;
+  }
+
   /// \brief Hook called whenever a macro definition is seen.
   void MacroDefined(const clang::Token &MacroNameTok,
                     const clang::MacroDirective *MD) override
@@ -193,9 +210,10 @@ class IndexPP : public clang::PPCallbacks
       return;
     }
 
-    string filename = filePath(start);
-    clang::SourceRange range(start, start.getLocWithOffset(MacroNameTok.getLength()));
-    macros_[filename].addMacro(this, MacroNameTok, filename, range);
+    auto decomposed = sourceManager_.getDecomposedLoc(start);
+    MacroRecord macro = { decomposed.second, MacroNameTok.getLength(),
+                          MacroNameTok.getIdentifierInfo(), clang::SourceLocation(), true };
+    records(decomposed.first).macros.push_back(macro);
   }
 
   /// \brief Called by Preprocessor::HandleMacroExpandedIdentifier when a
@@ -205,7 +223,7 @@ class IndexPP : public clang::PPCallbacks
                     clang::SourceRange,
                     const clang::MacroArgs *Args) override
   {
-    macroUsed(MacroNameTok, MD);
+    macroUsed(MacroNameTok, MD, true);
   }
 
   /// \brief Hook called whenever a macro \#undef is seen.
@@ -248,8 +266,23 @@ class IndexPP : public clang::PPCallbacks
   /// \param Range The SourceRange that was skipped. The range begins at the
   /// \#if/\#else directive and ends after the \#endif/\#else directive.
   void SourceRangeSkipped(clang::SourceRange Range) override {
-    // printf("%s\n", __FUNCTION__);
-    // FIXME
+    // grey out the lines between the directives, not the directives themselves
+    auto begin = sourceManager_.getDecomposedExpansionLoc(Range.getBegin());
+    auto end = sourceManager_.getDecomposedExpansionLoc(Range.getEnd());
+    if (begin.first != end.first)
+      return;
+    bool invalid = false;
+    llvm::StringRef buffer = sourceManager_.getBufferData(begin.first, &invalid);
+    if (invalid)
+      return;
+    size_t first = buffer.find('\n', begin.second);
+    size_t last = buffer.rfind('\n', end.second);
+    if (first == llvm::StringRef::npos || last == llvm::StringRef::npos || first >= last)
+      return;
+    SkippedRanges& skipped = skipped_[begin.first.getHashValue()];
+    if (skipped.ranges.empty())
+      skipped.file = fileTable_->id(begin.first);
+    skipped.ranges.push_back(std::make_pair(first + 1, last + 1));
   }
 
   string filePath(clang::FileID fileId) const
@@ -258,7 +291,7 @@ class IndexPP : public clang::PPCallbacks
       return "<invalid location>";
 
     if (const clang::FileEntry* fileEntry = sourceManager_.getFileEntryForID(fileId))
-      return fileEntry->getName();
+      return CanonicalPaths::get(sourceManager_, fileEntry);
 
     return kBuiltInFileName;
   }
@@ -301,7 +334,9 @@ class IndexPP : public clang::PPCallbacks
     }
   }
 
-  bool getFileContent(clang::SourceLocation location, std::string* content)
+  // The buffer of the file, owned by SourceManager or preprocessor_ for the
+  // life of the TU, large files are mmapped, see llvm::MemoryBuffer::getFile().
+  bool getFileContent(clang::SourceLocation location, llvm::StringRef* content)
   {
     assert(location.isFileID());
     clang::FileID fileId = sourceManager_.getFileID(location);
@@ -311,7 +346,7 @@ class IndexPP : public clang::PPCallbacks
       const llvm::MemoryBuffer* buffer = sourceManager_.getMemoryBufferForFile(fileEntry, &isInvalid);
       if (buffer && ! isInvalid)
       {
-        *content = buffer->getBuffer().str();
+        *content = buffer->getBuffer();
         return true;
       }
     }
@@ -323,55 +358,124 @@ class IndexPP : public clang::PPCallbacks
     return false;
   }
 
+  // Lines skipped by one inclusion, ranges may nest or overlap.
+  static void unionSkipped(std::vector<std::pair<unsigned, unsigned>>* ranges,
+                           proto::Intervals* intervals)
+  {
+    std::sort(ranges->begin(), ranges->end());
+    IntervalWriter writer(intervals);
+    unsigned begin = ranges->front().first, end = ranges->front().second;
+    for (const auto& range : *ranges)
+    {
+      if (range.first > end)
+      {
+        writer.add(begin, end);
+        begin = range.first;
+      }
+      end = std::max(end, range.second);
+    }
+    writer.add(begin, end);
+  }
+
   void macroUsed(const clang::Token &MacroNameTok,
-                 const clang::MacroDirective *MD)
+                 const clang::MacroDirective *MD,
+                 bool expands = false)
   {
     auto start = MacroNameTok.getLocation();
+    // only an expansion depends on the body of the definition
+    const clang::MacroInfo* info = expands && MD ? MD->getMacroInfo() : nullptr;
     if (start.isMacroID())
     {
-      // printf("don't know %s %s\n", __FUNCTION__, MacroNameTok.getIdentifierInfo()->getName().str().c_str());
+      // expanded in the body of another macro, its definition changes the
+      // tokens of the file which expanded that one
+      if (info)
+      {
+        clang::FileID fileId = sourceManager_.getFileID(sourceManager_.getExpansionLoc(start));
+        records(fileId).expanded.insert(std::make_pair(MacroNameTok.getIdentifierInfo(), info));
+      }
       return;
     }
 
-    std::string filename = filePath(start);
-    clang::SourceRange range(start, start.getLocWithOffset(MacroNameTok.getLength()));
-    // printf("%s %s %p\n", __FUNCTION__, MacroNameTok.getIdentifierInfo()->getName().str().c_str(), MD);
-    macros_[filename].addReference(this, MacroNameTok, filename, range, MD);
+    clang::SourceLocation definition;
+    if (MD && MD->getLocation().isValid() && MD->getLocation().isFileID())
+      definition = MD->getLocation();
+    auto decomposed = sourceManager_.getDecomposedLoc(start);
+    MacroRecord macro = { decomposed.second, MacroNameTok.getLength(),
+                          MacroNameTok.getIdentifierInfo(), definition, false };
+    FileRecords& fileRecords = records(decomposed.first);
+    fileRecords.macros.push_back(macro);
+    if (info)
+      fileRecords.expanded.insert(std::make_pair(MacroNameTok.getIdentifierInfo(), info));
   }
 
-  void findComments(clang::FileID fid)
+  // Target and language options, eg. -m32, -std or -fpack-struct, which
+  // change records of a header as much as its macros do, see HeaderCache.
+  static std::string optionsString(clang::CompilerInstance& compiler)
   {
-    const llvm::MemoryBuffer *FromFile = sourceManager_.getBuffer(fid);
-    clang::Lexer L(fid, FromFile, sourceManager_, compiler_.getLangOpts());
-    L.SetCommentRetentionState(true);
-    clang::Token rawTok;
-    do {
-      L.LexFromRawLexer(rawTok);
-      //unsigned TokOffs = sourceManager_.getFileOffset(rawTok.getLocation());
-      //unsigned TokLen = rawTok.getLength();
-      // comments
-      //if (rawTok.is(clang::tok::comment))
-      //  printf("off=%d len=%d kind=%s\n",
-      //         TokOffs, TokLen, clang::tok::getTokenName(rawTok.getKind()));
-      // string literals
-      // preprocess directives
-    } while (rawTok.isNot(clang::tok::eof));
+    const clang::TargetOptions& target = compiler.getTargetOpts();
+    std::string result = target.Triple + '\0' + target.CPU + '\0' + target.ABI;
+    for (const std::string& feature : target.FeaturesAsWritten)
+    {
+      result += '\0' + feature;
+    }
+    const clang::LangOptions& lang = compiler.getLangOpts();
+#define LANGOPT(Name, Bits, Default, Description) \
+    result += ' ' + std::to_string(lang.Name);
+#define ENUM_LANGOPT(Name, Type, Bits, Default, Description) \
+    result += ' ' + std::to_string(static_cast<unsigned>(lang.get##Name()));
+#include "clang/Basic/LangOptions.def"
+    return result;
   }
 
-  void saveSources(const std::string& mainFile) const
+  // Name, parameters and tokens of a definition, spelled.
+  std::string macroBody(const clang::IdentifierInfo* name, const clang::MacroInfo* info) const
+  {
+    std::string result = name->getName().str();
+    if (info->isFunctionLike())
+    {
+      result += '(';
+      for (auto it = info->arg_begin(); it != info->arg_end(); ++it)
+      {
+        result += (*it)->getName().str();
+        result += ',';
+      }
+      if (info->isVariadic())
+        result += "...";
+      result += ')';
+    }
+    for (auto it = info->tokens_begin(); it != info->tokens_end(); ++it)
+    {
+      result += ' ';
+      result += preprocessor_.getSpelling(*it);
+    }
+    return result;
+  }
+
+  void saveSources(const std::string& mainFile, std::map<std::string, MD5String>* md5s) const
   {
-    std::map<std::string, MD5String> md5s;
     for (const auto& src : files_)
     {
       MD5String md5 = md5String(src.second);
-      md5s[src.first] = md5;
-      std::string uri = "src:" + src.first;
-      // LOG_INFO << "Add " << uri;
-      sink_->writeOrDie(uri, src.second);
+      (*md5s)[src.first] = md5;
+      // the digest below refers to the blob, only inline the source when
+      // the store is not writable.
+      if (!blobs_.contains(md5) && !blobs_.put(md5, src.second))
+      {
+        std::string uri = "src:" + src.first;
+        // LOG_INFO << "Add " << uri;
+        sink_->writeOrDie(uri, src.second);
+      }
+      // scanned once per content, c.out highlights with it
+      else if (!blobs_.contains(md5, BlobStore::kSyntaxSuffix))
+      {
+        proto::Syntax syntax;
+        SyntaxScanner(src.second).scan(&syntax);
+        blobs_.put(md5, syntax.SerializeAsString(), BlobStore::kSyntaxSuffix);
+      }
     }
 
     proto::Digests digests;
-    for (const auto& d : md5s)
+    for (const auto& d : *md5s)
     {
       auto* digest = digests.add_digests();
       digest->set_filename(d.first);
@@ -387,115 +491,251 @@ class IndexPP : public clang::PPCallbacks
     sink_->writeOrDie(uri, content);
   }
 
-  // Record include's for a source file
-  struct Inclusions
+  // Callbacks run for every macro expansion and #include, so they only
+  // append these to the records of their FileID, which EndOfMainFile() sorts
+  // and turns into messages once per file.
+  struct MacroRecord
+  {
+    unsigned offset;  // of the name
+    unsigned length;
+    const clang::IdentifierInfo* name;
+    clang::SourceLocation definition;  // of a reference, if known
+    bool define;
+  };
+
+  struct IncludeRecord
   {
-    // return true if added a new item or same item.
-    bool add(unsigned lineno, std::string& includedFile, bool isMacro, proto::Range* range)
+    unsigned offset;  // of '#'
+    const clang::FileEntry* file;
+    // of the filename, or the macro naming it, invalid if unknown
+    clang::SourceLocation begin;
+    clang::SourceLocation end;
+    bool isMacro;
+  };
+
+  struct FileRecords
+  {
+    // the first FileID of the file, its offsets are those of the others
+    clang::FileID fileId;
+    std::vector<MacroRecord> macros;
+    std::vector<IncludeRecord> includes;
+    // name and definition of every macro expanded, see definitionsDigest()
+    std::set<std::pair<const clang::IdentifierInfo*, const clang::MacroInfo*>> expanded;
+  };
+
+  // callbacks come in runs of the same FileID, so the last one is cached
+  FileRecords& records(clang::FileID fileId)
+  {
+    if (lastRecords_ == nullptr || fileId != lastFileId_)
     {
-      std::unique_ptr<proto::Inclusion>& inc = includes_[lineno];
-      if (inc)
-      {
-        if (inc->included_file() != includedFile)
-        {
-          // TODO: check other
-          // FIXME: update ?
-          inc->set_changed(true);
-          return false;
-        }
-      }
-      else
-      {
-        inc.reset(new proto::Inclusion);
-        inc->set_included_file(includedFile);
-        inc->set_lineno(lineno);
-        if (isMacro)
-          inc->set_macro(isMacro);
-        inc->mutable_range()->Swap(range);
-      }
-      return true;
+      // node based, so the pointer stays valid
+      lastRecords_ = &records_[fileId.getHashValue()];
+      lastRecords_->fileId = fileId;
+      lastFileId_ = fileId;
     }
+    return *lastRecords_;
+  }
 
-    void fill(proto::Preprocess* pp)
+  // Records of every FileID appended to those of its file, in order of
+  // FileIDs, ie. of inclusion, keyed by file ID of FileTable.
+  std::unordered_map<int, FileRecords> mergeRecords()
+  {
+    std::vector<unsigned> fileIds;
+    fileIds.reserve(records_.size());
+    for (const auto& it : records_)
     {
-      for (auto& it : includes_)
+      fileIds.push_back(it.first);
+    }
+    std::sort(fileIds.begin(), fileIds.end());
+    std::unordered_map<int, FileRecords> merged;
+    for (unsigned fileId : fileIds)
+    {
+      FileRecords& from = records_[fileId];
+      FileRecords& to = merged[fileTable_->id(from.fileId)];
+      if (to.fileId.isInvalid())
       {
-        pp->mutable_includes()->AddAllocated(it.second.release());
+        to.fileId = from.fileId;
+        to.macros.swap(from.macros);
+        to.includes.swap(from.includes);
+        to.expanded.swap(from.expanded);
+        continue;
       }
+      to.macros.insert(to.macros.end(), from.macros.begin(), from.macros.end());
+      to.includes.insert(to.includes.end(), from.includes.begin(), from.includes.end());
+      to.expanded.insert(from.expanded.begin(), from.expanded.end());
     }
+    records_.clear();
+    lastRecords_ = nullptr;
+    return merged;
+  }
 
-    // lineno to included_file
-    std::map<unsigned, std::unique_ptr<proto::Inclusion>> includes_;
-  };
-
-  struct Macros
+  // Lines skipped in every inclusion of a file, keyed by file ID of FileTable,
+  // as a line compiled by one inclusion, eg. of a header included twice with
+  // different macros, is not dead in this TU.  See Joiner::intersectSkipped()
+  // for intersecting over TUs.
+  std::unordered_map<int, proto::Intervals> mergeSkipped()
   {
-    proto::Macro* addMacro(IndexPP* pp,
-                           const clang::Token& macroNameTok,
-                           const std::string& filename,
-                           const clang::SourceRange& srcRange,
-                           bool define = true)
+    std::unordered_map<int, proto::Intervals> merged;
+    std::unordered_map<int, int> counts;
+    for (auto& it : skipped_)
     {
-      unsigned offset = pp->sourceManager_.getDecomposedSpellingLoc(srcRange.getBegin()).second;
-      auto& macro = macros_[offset];
-      if (macro)
-      {
-        // FIXME: check identical
-      }
+      const int file = it.second.file;
+      proto::Intervals intervals;
+      unionSkipped(&it.second.ranges, &intervals);
+      if (++counts[file] == 1)
+        merged[file].Swap(&intervals);
       else
+        intersectIntervals(merged[file], intervals, &merged[file]);
+    }
+    for (const auto& it : counts)
+    {
+      // an inclusion which skipped nothing
+      if (it.second < inclusions_[it.first])
+        merged.erase(it.first);
+    }
+    for (auto it = merged.begin(); it != merged.end(); )
+    {
+      if (it->second.deltas_size() == 0)
+        it = merged.erase(it);
+      else
+        ++it;
+    }
+    skipped_.clear();
+    return merged;
+  }
+
+  // Digest of options_ and of the definitions of macros expanded in a file,
+  // which the "prep:" record only refers to by location, so -DFOO=1 and
+  // -DFOO=2 make two keys.  records may be null.
+  std::string definitionsDigest(const FileRecords* records) const
+  {
+    std::vector<std::string> bodies;
+    if (records)
+    {
+      for (const auto& it : records->expanded)
       {
-        macro.reset(new proto::Macro);
-        macro->set_name(macroNameTok.getIdentifierInfo()->getName());
-        if (define)
-          macro->set_define(define);
-        pp->sourceRangeToRange(srcRange, macro->mutable_range());
+        bodies.push_back(macroBody(it.first, it.second));
       }
-      return macro.get();
     }
+    // pointers order the set differently in each run
+    std::sort(bodies.begin(), bodies.end());
+    std::string all = options_;
+    for (const std::string& body : bodies)
+    {
+      all += '\0';
+      all += body;
+    }
+    return md5String(all).str().str();
+  }
 
-    void addReference(IndexPP* pp,
-                      const clang::Token& macroNameTok,
-                      const std::string& filename,
-                      const clang::SourceRange& srcRange,
-                      const clang::MacroDirective *MD)
+  // One Inclusion per line, the first one, which is marked changed if a
+  // later inclusion of the file included another file on that line.
+  void fillIncludes(FileRecords* records, proto::Preprocess* pp)
+  {
+    // lineno and index in records->includes
+    std::vector<std::pair<unsigned, size_t>> lines;
+    lines.reserve(records->includes.size());
+    LineTable& table = util_.lineTable(records->fileId);
+    for (size_t i = 0; i < records->includes.size(); ++i)
     {
-      proto::Macro* macro = addMacro(pp, macroNameTok, filename, srcRange, false);
-      macro->set_reference(true);
-      if (MD)
+      lines.push_back(std::make_pair(table.line(records->includes[i].offset), i));
+    }
+    std::sort(lines.begin(), lines.end());
+    proto::Inclusion* inc = nullptr;
+    for (size_t i = 0; i < lines.size(); ++i)
+    {
+      const IncludeRecord& record = records->includes[lines[i].second];
+      const int includedFile = fileTable_->id(record.file);
+      if (i > 0 && lines[i].first == lines[i-1].first)
       {
-        auto loc = MD->getLocation();
-        if (!loc.isInvalid() && loc.isFileID())
+        if (inc->included_file() != includedFile)
         {
-          macro->set_ref_file(pp->filePath(loc));
-          macro->set_ref_lineno(pp->sourceManager_.getSpellingLineNumber(loc));
+          LOG_WARN << "#include changed at " << pp->filename() << ":" << lines[i].first
+                   << " -> " << fileTable_->path(includedFile);
+          inc->set_changed(true);
         }
+        continue;
       }
+      inc = google::protobuf::Arena::CreateMessage<proto::Inclusion>(&arena_);
+      inc->set_included_file(includedFile);
+      inc->set_lineno(lines[i].first);
+      if (record.isMacro)
+        inc->set_macro(true);
+      proto::Range* range = inc->mutable_range();
+      if (record.begin.isValid())
+        sourceRangeToRange(clang::SourceRange(record.begin, record.end), range);
+      pp->mutable_includes()->UnsafeArenaAddAllocated(inc);
     }
+  }
 
-    void fill(proto::Preprocess* pp)
+  // One Macro per offset, defined by the first record, and referring to the
+  // definition of the last reference which knows it.
+  void fillMacros(FileRecords* records, proto::Preprocess* pp)
+  {
+    std::vector<MacroRecord>& macros = records->macros;
+    std::stable_sort(macros.begin(), macros.end(),
+                     [](const MacroRecord& lhs, const MacroRecord& rhs)
+                     { return lhs.offset < rhs.offset; });
+    for (size_t i = 0; i < macros.size(); )
     {
-      for (auto& it : macros_)
+      const MacroRecord& first = macros[i];
+      bool reference = false;
+      const MacroRecord* ref = nullptr;
+      for (; i < macros.size() && macros[i].offset == first.offset; ++i)
+      {
+        reference |= !macros[i].define;
+        if (macros[i].definition.isValid())
+          ref = &macros[i];
+      }
+      proto::Macro* macro = google::protobuf::Arena::CreateMessage<proto::Macro>(&arena_);
+      macro->set_name(first.name->getName());
+      if (first.define)
+        macro->set_define(true);
+      clang::SourceLocation begin = sourceManager_.getComposedLoc(records->fileId, first.offset);
+      sourceRangeToRange(clang::SourceRange(begin, begin.getLocWithOffset(first.length)),
+                         macro->mutable_range());
+      if (reference)
+        macro->set_reference(true);
+      if (ref)
       {
-        pp->mutable_macros()->AddAllocated(it.second.release());
+        macro->set_ref_file(fileTable_->id(ref->definition));
+        macro->set_ref_lineno(sourceManager_.getSpellingLineNumber(ref->definition));
       }
+      pp->mutable_macros()->UnsafeArenaAddAllocated(macro);
     }
-
-    // offset to macro
-    std::map<unsigned, std::unique_ptr<proto::Macro>> macros_;
-  };
+  }
 
   clang::CompilerInstance& compiler_;
   const clang::Preprocessor& preprocessor_;
   clang::SourceManager& sourceManager_;
   const Util util_;
   Sink* sink_;
-
-  // map from filename to file content
-  std::map<std::string, std::string> files_;
-  // map from filename to inclusions
-  std::unordered_map<std::string, Inclusions> inclusions_;
-  // map from filename to macros
-  std::unordered_map<std::string, Macros> macros_;
+  Stats* stats_;
+  FileTable* fileTable_;
+  // see optionsString()
+  const std::string options_;
+  const BlobStore blobs_;
+  // all messages of a TU, freed in one shot with IndexPP
+  google::protobuf::Arena arena_;
+
+  // map from filename to file content, in buffers of sourceManager_
+  std::map<std::string, llvm::StringRef> files_;
+  // map from FileID to records of callbacks, see records()
+  std::unordered_map<unsigned, FileRecords> records_;
+  clang::FileID lastFileId_;
+  FileRecords* lastRecords_ = nullptr;
+  struct SkippedRanges
+  {
+    int file = -1;  // ID in FileTable
+    // [begin, end) offsets of lines skipped by #if
+    std::vector<std::pair<unsigned, unsigned>> ranges;
+  };
+  // map from FileID to lines it skipped
+  std::unordered_map<unsigned, SkippedRanges> skipped_;
+  // map from file ID to number of its FileIDs, ie. times it was entered
+  std::unordered_map<int, int> inclusions_;
+  // map from filename to HeaderCache key
+  std::map<std::string, std::string> headerKeys_;
 
 };
 
@@ -7,21 +7,32 @@
 
 #include "muduo/base/Logging.h"
 
+#include <boost/noncopyable.hpp>
+
 #include <unordered_set>
 
 #include <stdio.h>
 
 namespace indexer
 {
+#include "intervals.h"
 
 class Formatter
 {
   std::unique_ptr<leveldb::DB> db_;
+  proto::FileTable files_;
  public:
 
   explicit Formatter(leveldb::DB* db)
     : db_(db)
   {
+    // paths by file ID, see joiner
+    std::string content;
+    if (db_->Get(leveldb::ReadOptions(), "files:", &content).ok())
+    {
+      if (!files_.ParseFromString(content))
+        assert(0);
+    }
   }
 
   std::string format(const std::string& srcuri, std::string* html)
@@ -42,8 +53,11 @@ class Formatter
 
     srcuri.remove_prefix(4); // "src:"
     std::string filename = srcuri.ToString();
-    formatPreprocess(filename, &rb);
+    proto::Preprocess pp;
+    formatPreprocess(filename, &pp, &rb);
     formatFile(filename, &rb);
+    formatSyntax(filename, &rb);
+    formatSkipped(pp, &rb);
 
     int numlines = escapeHtml(text, &rb);
     std::vector<std::string> headers;
@@ -68,13 +82,14 @@ class Formatter
   }
 
  private:
-  void formatPreprocess(const std::string& filename, clang::RewriteBuffer* rb)
+  void formatPreprocess(const std::string& filename, proto::Preprocess* prep,
+                        clang::RewriteBuffer* rb)
   {
     std::string content;
     leveldb::Status s = db_->Get(leveldb::ReadOptions(), "prep:" + filename, &content);
     if (!s.ok())
       return;
-    proto::Preprocess pp;
+    proto::Preprocess& pp = *prep;
     if (!pp.ParseFromString(content))
       assert(0);
     assert(filename == pp.filename());
@@ -82,8 +97,7 @@ class Formatter
     {
       if (!inc.changed())
       {
-        rb->InsertTextBefore(inc.range().begin().offset(), makeHref(inc.included_file()));
-        rb->InsertTextAfter(inc.range().end().offset(), "</a>");
+        insertHref(inc.range(), inc.included_file(), 0, rb);
       }
     }
     for (const auto& macro : pp.macros())
@@ -93,13 +107,9 @@ class Formatter
         rb->InsertTextBefore(macro.range().begin().offset(), R"(<span class="macro-def">)");
         rb->InsertTextAfter(macro.range().end().offset(), "</span>");
       }
-      else if (macro.reference() && macro.ref_lineno() > 0)
-      {
-        rb->InsertTextBefore(macro.range().begin().offset(),
-                             makeHref(macro.ref_file(), macro.ref_lineno()));
-        rb->InsertTextAfter(macro.range().end().offset(), "</a>");
-      }
-      else
+      // a reference without a link is marked as a use
+      else if (!(macro.reference() && macro.ref_lineno() > 0
+                 && insertHref(macro.range(), macro.ref_file(), macro.ref_lineno(), rb)))
       {
         rb->InsertTextBefore(macro.range().begin().offset(), R"(<span class="macro-use">)");
         rb->InsertTextAfter(macro.range().end().offset(), "</span>");
@@ -122,11 +132,10 @@ class Formatter
     {
       if (func.range().anchor())
         continue;
-      if (func.ref_file_size() == 1 && func.ref_lineno_size() == 1)
+      const proto::Symbol& sym = file.symbols(func.symbol());
+      if (func.usage() != proto::kDefine && sym.ref_file_size() == 1 && sym.ref_lineno_size() == 1)
       {
-        rb->InsertTextBefore(func.range().begin().offset(),
-                             makeHref(func.ref_file().Get(0), func.ref_lineno().Get(0)));
-        rb->InsertTextAfter(func.range().end().offset(), "</a>");
+        insertHref(func.range(), sym.ref_file(0), sym.ref_lineno(0), rb);
       }
       else if (func.usage() == proto::kDefine)
       {
@@ -141,9 +150,7 @@ class Formatter
         continue;
       if (st.ref_file_size() == 1 && st.ref_lineno_size() == 1)
       {
-        rb->InsertTextBefore(st.range().begin().offset(),
-                             makeHref(st.ref_file().Get(0), st.ref_lineno().Get(0)));
-        rb->InsertTextAfter(st.range().end().offset(), "</a>");
+        insertHref(st.range(), st.ref_file(0), st.ref_lineno(0), rb);
       }
       else if (st.usage() == proto::kDefine)
       {
@@ -155,6 +162,57 @@ class Formatter
 
   }
 
+  // Inserted last, so these spans enclose the links inside a comment.
+  void formatSyntax(const std::string& filename, clang::RewriteBuffer* rb)
+  {
+    std::string content;
+    leveldb::Status s = db_->Get(leveldb::ReadOptions(), "syntax:" + filename, &content);
+    if (!s.ok())
+      return;
+    proto::Syntax syntax;
+    if (!syntax.ParseFromString(content))
+      assert(0);
+    for (const auto& decl : syntax.declarators())
+    {
+      const char* span = decl.type() == proto::Declarator::COMMENT ? R"(<span class="comment">)"
+                       : decl.type() == proto::Declarator::STRING ? R"(<span class="string">)"
+                       : R"(<span class="number">)";
+      forEachInterval(decl.intervals(), [rb, span](uint32_t begin, uint32_t end) {
+        rb->InsertTextBefore(begin, span);
+        rb->InsertTextAfter(end, "</span>");
+      });
+    }
+  }
+
+  // Lines skipped by #if in every TU, outermost as they start at line begin.
+  void formatSkipped(const proto::Preprocess& pp, clang::RewriteBuffer* rb)
+  {
+    for (const auto& decl : pp.declarators())
+    {
+      if (decl.type() != proto::Declarator::SKIPPED)
+        continue;
+      forEachInterval(decl.intervals(), [rb](uint32_t begin, uint32_t end) {
+        rb->InsertTextBefore(begin, R"(<span class="skipped">)");
+        rb->InsertTextAfter(end, "</span>");
+      });
+    }
+  }
+
+  // Links range to lineno of a file, or returns false without a link if the
+  // file ID is not in "files:", eg. records of another join.
+  bool insertHref(const proto::Range& range, int fileId, int lineno,
+                  clang::RewriteBuffer* rb) const
+  {
+    if (fileId < 0 || fileId >= files_.files_size())
+    {
+      LOG_ERROR << "Unknown file ID " << fileId << " of " << files_.files_size();
+      return false;
+    }
+    rb->InsertTextBefore(range.begin().offset(), makeHref(files_.files(fileId), lineno));
+    rb->InsertTextAfter(range.end().offset(), "</a>");
+    return true;
+  }
+
   static std::string makeHref(const std::string& filename, int lineno = 0)
   {
     std::string result = "<a href=\"" + getHtmlFilename(filename);
@@ -0,0 +1,204 @@
+// Finds comments, string and character literals, and numbers of a source
+// file without a clang::Lexer, so it runs once per file digest instead of once
+// per TU, see IndexPP::saveSources().
+//
+// Most bytes are neither of them, with SSE2 16 bytes are skipped at a time
+// until one that may start a comment, a literal or a number.  Like the raw
+// lexer, it knows nothing about preprocessing, eg. an apostrophe in #error
+// starts a character literal till the end of line.
+class SyntaxScanner : boost::noncopyable
+{
+ public:
+  explicit SyntaxScanner(llvm::StringRef text)
+    : begin_(text.data()),
+      end_(text.data() + text.size())
+  {
+  }
+
+  // one Declarator of each type with all its intervals
+  void scan(proto::Syntax* syntax) const
+  {
+    auto* comment = syntax->add_declarators();
+    comment->set_type(proto::Declarator::COMMENT);
+    auto* str = syntax->add_declarators();
+    str->set_type(proto::Declarator::STRING);
+    auto* number = syntax->add_declarators();
+    number->set_type(proto::Declarator::NUMBER);
+    IntervalWriter comments(comment->mutable_intervals());
+    IntervalWriter strings(str->mutable_intervals());
+    IntervalWriter numbers(number->mutable_intervals());
+
+    const char* p = begin_;
+    while ((p = findStart(p)) < end_)
+    {
+      const char* start = p;
+      if (*p == '/')
+      {
+        if (p + 1 < end_ && p[1] == '/')
+          p = endOfLineComment(p + 2);
+        else if (p + 1 < end_ && p[1] == '*')
+          p = endOfBlockComment(p + 2);
+        else
+        {
+          ++p;
+          continue;
+        }
+        comments.add(offset(start), offset(p));
+      }
+      else if (*p == '"' || *p == '\'')
+      {
+        p = endOfLiteral(p + 1, *p);
+        strings.add(offset(start), offset(p));
+      }
+      else if (p > begin_ && isIdentifierBody(p[-1]))
+      {
+        // digits in an identifier, eg. u32
+        while (p < end_ && isIdentifierBody(*p))
+          ++p;
+      }
+      else
+      {
+        // .5
+        if (p > begin_ && p[-1] == '.' && !(p - 1 > begin_ && isIdentifierBody(p[-2])))
+          --start;
+        p = endOfNumber(p);
+        numbers.add(offset(start), offset(p));
+      }
+    }
+  }
+
+ private:
+  uint32_t offset(const char* p) const
+  {
+    return static_cast<uint32_t>(p - begin_);
+  }
+
+  // UTF-8 bytes are allowed in identifiers
+  static bool isIdentifierBody(char ch)
+  {
+    unsigned char c = static_cast<unsigned char>(ch);
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+        || c == '_' || c == '$' || c >= 0x80;
+  }
+
+  static bool isStart(char ch)
+  {
+    return ch == '/' || ch == '"' || ch == '\'' || (ch >= '0' && ch <= '9');
+  }
+
+  // first '/', '"', '\'' or digit
+  const char* findStart(const char* p) const
+  {
+#ifdef __SSE2__
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i dquote = _mm_set1_epi8('"');
+    const __m128i squote = _mm_set1_epi8('\'');
+    const __m128i belowDigit = _mm_set1_epi8('0' - 1);
+    const __m128i aboveDigit = _mm_set1_epi8('9' + 1);
+    for (; p + 16 <= end_; p += 16)
+    {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      __m128i quotes = _mm_or_si128(_mm_cmpeq_epi8(x, dquote), _mm_cmpeq_epi8(x, squote));
+      __m128i digits = _mm_and_si128(_mm_cmpgt_epi8(x, belowDigit), _mm_cmplt_epi8(x, aboveDigit));
+      int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(quotes, digits),
+                                                _mm_cmpeq_epi8(x, slash)));
+      if (mask != 0)
+        return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end_ && !isStart(*p))
+      ++p;
+    return p;
+  }
+
+  // first quote, '\\' or '\n'
+  const char* findLiteralStop(const char* p, char quote) const
+  {
+#ifdef __SSE2__
+    const __m128i q = _mm_set1_epi8(quote);
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; p + 16 <= end_; p += 16)
+    {
+      __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      int mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, q),
+                                                             _mm_cmpeq_epi8(x, backslash)),
+                                                _mm_cmpeq_epi8(x, newline)));
+      if (mask != 0)
+        return p + __builtin_ctz(mask);
+    }
+#endif
+    while (p < end_ && *p != quote && *p != '\\' && *p != '\n')
+      ++p;
+    return p;
+  }
+
+  // past the closing quote, or at the end of line if unterminated
+  const char* endOfLiteral(const char* p, char quote) const
+  {
+    while ((p = findLiteralStop(p, quote)) < end_)
+    {
+      if (*p == '\\')
+        p += 2;  // also an escaped newline
+      else if (*p == quote)
+        return p + 1;
+      else
+        return p;
+    }
+    return end_;
+  }
+
+  // at the newline, unless escaped by '\\'
+  const char* endOfLineComment(const char* p) const
+  {
+    while (p < end_)
+    {
+      const char* nl = static_cast<const char*>(::memchr(p, '\n', end_ - p));
+      if (nl == nullptr)
+        return end_;
+      const char* last = nl;
+      if (last > p && last[-1] == '\r')
+        --last;
+      if (last > p && last[-1] == '\\')
+        p = nl + 1;
+      else
+        return nl;
+    }
+    return end_;
+  }
+
+  // past "*/"
+  const char* endOfBlockComment(const char* p) const
+  {
+    while (p < end_)
+    {
+      const char* star = static_cast<const char*>(::memchr(p, '*', end_ - p));
+      if (star == nullptr || star + 1 == end_)
+        return end_;
+      if (star[1] == '/')
+        return star + 2;
+      p = star + 1;
+    }
+    return end_;
+  }
+
+  // a preprocessing number, eg. 0x1fUL, 1.5e-3
+  const char* endOfNumber(const char* p) const
+  {
+    while (p < end_)
+    {
+      char ch = *p;
+      if ((ch == 'e' || ch == 'E' || ch == 'p' || ch == 'P')
+          && p + 1 < end_ && (p[1] == '+' || p[1] == '-'))
+        p += 2;
+      else if (isIdentifierBody(ch) || ch == '.')
+        ++p;
+      else
+        break;
+    }
+    return p;
+  }
+
+  const char* const begin_;
+  const char* const end_;
+};
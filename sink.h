@@ -1,5 +1,5 @@
 typedef llvm::SmallString<32> MD5String;
-inline MD5String md5String(const std::string& text)
+inline MD5String md5String(llvm::StringRef text)
 {
   MD5String str;
   llvm::MD5 md5;
@@ -35,11 +35,22 @@ class Sink : boost::noncopyable
 
   int count() const { return count_; }
 
-  void writeOrDie(const string& key, const string& value)
+  struct Counter
+  {
+    int records = 0;
+    int64_t bytes = 0;
+  };
+
+  // key is prefix of keys, eg. "file:"
+  const std::map<string, Counter>& counters() const { return counters_; }
+
+  // value may refer to a buffer of clang, eg. a source file
+  void writeOrDie(const string& key, llvm::StringRef value)
   {
     if (db_)
     {
-      leveldb::Status s = db_->Put(leveldb::WriteOptions(), key, value);
+      leveldb::Status s = db_->Put(leveldb::WriteOptions(), key,
+                                   leveldb::Slice(value.data(), value.size()));
       assert(s.ok());
       printf("write %s %zd\n", key.c_str(), value.size());
     }
@@ -57,6 +68,9 @@ class Sink : boost::noncopyable
       }
     }
     ++count_;
+    Counter& counter = counters_[key.substr(0, key.find(':') + 1)];
+    ++counter.records;
+    counter.bytes += key.size() + value.size();
     if (value.size() > max_value_)
     {
       max_key_ = key;
@@ -68,30 +82,32 @@ class Sink : boost::noncopyable
   leveldb::DB* db_ = nullptr;  // not owned
   FILE* out_ = nullptr;
   int count_ = 0;
+  std::map<string, Counter> counters_;
   string max_key_;
   unsigned max_value_ = 0;
 };
 
+// Reads nothing if file can't be opened, see valid().
 class Reader : boost::noncopyable
 {
  public:
   Reader(const char* file)
     : fp_(::fopen(file, "rb")),
-      size_(size())
+      size_(fp_ ? size() : 0)
   {
-    assert(fp_);
   }
 
   ~Reader()
   {
-    ::fclose(fp_);
+    if (fp_)
+      ::fclose(fp_);
   }
 
   bool valid() const { return fp_; }
 
   bool read(string* key, string* value)
   {
-    if (curr() < size_)
+    if (fp_ && curr() < size_)
     {
       int key_len = readInt32();
       *key = readBytes(key_len);
@@ -165,10 +181,22 @@ inline void print(leveldb::Slice key, const string& content)
   {
     parseAndPrint<indexer::proto::SourceFile>(content);
   }
+  else if (key == "files:")
+  {
+    parseAndPrint<indexer::proto::FileTable>(content);
+  }
   else if (key.starts_with("prep:"))
   {
     parseAndPrint<indexer::proto::Preprocess>(content);
   }
+  else if (key.starts_with("stats:"))
+  {
+    parseAndPrint<indexer::proto::Stats>(content);
+  }
+  else if (key.starts_with("syntax:"))
+  {
+    parseAndPrint<indexer::proto::Syntax>(content);
+  }
   else
   {
     printf("don't know how to print %s\n", key.data());
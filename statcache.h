@@ -0,0 +1,179 @@
+// Paths which didn't exist when clang looked them up, kept across runs in
+// one file per build tree, shared by all FileManagers of a process.
+//
+// Most stats of a TU are misses of #include lookups through the long -I
+// list, every header is looked up in each -I directory in turn, and so are
+// missing -I directories themselves.  A missing name is recorded with the
+// mtime of its parent directory, which changes whenever a name is created
+// or removed in it, or -1 if the parent was missing as well.  On load, a
+// directory whose mtime differs drops all its names.
+//
+// Only misses are cached, an existing file is always stat'ed by clang, as
+// writing a file in place changes its size but not the mtime of its parent.
+class StatCache : boost::noncopyable
+{
+ public:
+  explicit StatCache(const string& path)
+    : path_(path)
+  {
+    string content;
+    proto::StatCache cache;
+    if (muduo::FileUtil::readFile(path_, 1024*1024*1024, &content) != 0
+        || !cache.ParseFromString(content))
+      return;
+    int stale = 0;
+    for (const auto& dir : cache.directories())
+    {
+      if (mtime(dir.path()) != dir.mtime())
+      {
+        ++stale;
+        continue;
+      }
+      Directory& d = directories_[dir.path()];
+      d.mtime = dir.mtime();
+      d.missing.insert(dir.missing().begin(), dir.missing().end());
+    }
+    LOG_INFO << "StatCache " << directories_.size() << " directories, " << stale << " stale";
+  }
+
+  // A new FileManager owns the returned cache, see FileManager::addStatCache().
+  clang::FileSystemStatCache* lookup()
+  {
+    return new Lookup(this);
+  }
+
+  // Children of BatchIndexer::useFork() only read it.
+  bool save() const
+  {
+    proto::StatCache cache;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (added_ == 0)
+        return true;
+      for (const auto& it : directories_)
+      {
+        if (it.second.missing.empty())
+          continue;
+        proto::StatCache::Directory* dir = cache.add_directories();
+        dir->set_path(it.first);
+        dir->set_mtime(it.second.mtime);
+        for (const string& name : it.second.missing)
+        {
+          dir->add_missing(name);
+        }
+      }
+    }
+    // single TU runs of a build tree may save concurrently
+    string tmp = path_ + ".tmp" + std::to_string(::getpid());
+    FILE* fp = ::fopen(tmp.c_str(), "wb");
+    if (fp == nullptr)
+    {
+      LOG_SYSERR << "StatCache " << tmp;
+      return false;
+    }
+    string content = cache.SerializeAsString();
+    bool ok = ::fwrite(content.data(), 1, content.size(), fp) == content.size();
+    ok = (::fclose(fp) == 0) && ok;
+    if (!ok || ::rename(tmp.c_str(), path_.c_str()) != 0)
+    {
+      LOG_SYSERR << "StatCache save " << path_;
+      ::unlink(tmp.c_str());
+      return false;
+    }
+    LOG_INFO << "StatCache saved " << cache.directories_size() << " directories";
+    return true;
+  }
+
+  int hits() const { return hits_; }
+  int misses() const { return misses_; }
+
+ private:
+  class Lookup : public clang::FileSystemStatCache
+  {
+   public:
+    explicit Lookup(StatCache* cache)
+      : cache_(cache)
+    {
+    }
+
+   protected:
+    LookupResult getStat(const char* path, clang::FileData& data, bool isFile,
+                         clang::vfs::File** file, clang::vfs::FileSystem& fs) override
+    {
+      llvm::StringRef dir = llvm::sys::path::parent_path(path);
+      llvm::StringRef name = llvm::sys::path::filename(path);
+      if (dir.empty())
+        dir = ".";
+      int64_t dirMtime = 0;
+      if (cache_->missing(dir, name, &dirMtime))
+        return CacheMissing;
+      // dirMtime was taken before the stat, so a name created in between
+      // makes the recorded miss stale on the next load
+      LookupResult result = statChained(path, data, isFile, file, fs);
+      if (result == CacheMissing)
+        cache_->addMissing(dir, name, dirMtime);
+      return result;
+    }
+
+   private:
+    StatCache* cache_;
+  };
+
+  struct Directory
+  {
+    int64_t mtime = -1;
+    std::unordered_set<string> missing;
+  };
+
+  // true if name was missing in dir, otherwise the mtime of dir
+  bool missing(llvm::StringRef dir, llvm::StringRef name, int64_t* dirMtime)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = directories_.find(dir.str());
+      if (it != directories_.end())
+      {
+        if (it->second.missing.count(name.str()))
+        {
+          ++hits_;
+          return true;
+        }
+        ++misses_;
+        *dirMtime = it->second.mtime;
+        return false;
+      }
+    }
+    // stat each directory once per run, the tree doesn't change while indexed
+    int64_t m = mtime(dir.str());
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++misses_;
+    Directory& d = directories_[dir.str()];
+    d.mtime = m;
+    *dirMtime = m;
+    return false;
+  }
+
+  void addMissing(llvm::StringRef dir, llvm::StringRef name, int64_t dirMtime)
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Directory& d = directories_[dir.str()];
+    if (d.mtime == dirMtime && d.missing.insert(name.str()).second)
+      ++added_;
+  }
+
+  // in nanoseconds, -1 if missing
+  static int64_t mtime(const string& path)
+  {
+    struct stat st;
+    if (::stat(path.c_str(), &st) != 0)
+      return -1;
+    return st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+
+  const string path_;
+  mutable std::mutex mutex_;
+  std::unordered_map<string, Directory> directories_;
+  int added_ = 0;
+  std::atomic<int> hits_{0};
+  std::atomic<int> misses_{0};
+};
@@ -0,0 +1,77 @@
+// Cost of indexing one TU, written as "stats:<main>" and summed over a batch
+// by d.out -stats.
+//
+// Clang preprocesses while it parses, so parse time includes preprocessing,
+// but not the records IndexPP writes at the end of the main file, nor the
+// traversal of decls indexed while parsing, see IndexConsumer::Initialize().
+class Stats : boost::noncopyable
+{
+ public:
+  // Adds the lifetime of a scope to one phase.
+  class Timer : boost::noncopyable
+  {
+   public:
+    explicit Timer(int64_t* us)
+      : us_(us),
+        start_(now())
+    {
+    }
+
+    ~Timer()
+    {
+      *us_ += now() - start_;
+    }
+
+   private:
+    int64_t* us_;
+    const int64_t start_;
+  };
+
+  Stats()
+    : start_(now())
+  {
+  }
+
+  // called when the AST is complete
+  void endParse()
+  {
+    parseUs = now() - start_ - traverseUs - serializeUs - writeUs;
+  }
+
+  void save(Sink* sink, const string& mainFile, bool failed) const
+  {
+    proto::Stats stats;
+    stats.set_main_file(mainFile);
+    stats.set_parse_us(parseUs);
+    stats.set_traverse_us(traverseUs);
+    stats.set_serialize_us(serializeUs);
+    stats.set_write_us(writeUs);
+    for (const auto& it : sink->counters())
+    {
+      auto* count = stats.add_counts();
+      count->set_prefix(it.first);
+      count->set_records(it.second.records);
+      count->set_bytes(it.second.bytes);
+    }
+    // of the whole process, ie. of the batch so far if not forked
+    struct rusage usage;
+    if (::getrusage(RUSAGE_SELF, &usage) == 0)
+      stats.set_max_rss_kb(usage.ru_maxrss);
+    if (failed)
+      stats.set_failed(true);
+    sink->writeOrDie("stats:" + mainFile, stats.SerializeAsString());
+  }
+
+  int64_t parseUs = 0;
+  int64_t traverseUs = 0;
+  int64_t serializeUs = 0;
+  int64_t writeUs = 0;
+
+ private:
+  static int64_t now()
+  {
+    return muduo::Timestamp::now().microSecondsSinceEpoch();
+  }
+
+  const int64_t start_;
+};
@@ -0,0 +1,49 @@
+#!/bin/sh
+# An incremental batch run from a cwd other than the build directory must
+# reindex a TU after a header it includes is edited, see Manifest.
+#
+#   ninja a.out && testdata/incremental_test.sh [./a.out]
+set -e
+indexer=$(realpath "${1:-./a.out}")
+top=$(mktemp -d)
+trap 'rm -rf "$top"' EXIT
+mkdir -p "$top/build" "$top/run/tmp"
+
+cat > "$top/build/inc.h" <<END
+int inc(void);
+END
+cat > "$top/build/main.c" <<END
+#include "inc.h"
+int main() { return inc(); }
+END
+cat > "$top/build/compile_commands.json" <<END
+[
+  {
+    "directory": "$top/build",
+    "command": "clang -c $top/build/main.c -o main.o",
+    "file": "$top/build/main.c"
+  }
+]
+END
+
+# the Indexed line is logged as "... F failed, S unchanged, ..."
+batch()
+{
+  (cd "$top/run" && "$indexer" -batch "$top/build" -j 1 -incremental 2>&1) \
+    | grep "Indexed " | sed 's/.* failed, \([0-9]*\) unchanged.*/\1/'
+}
+
+check()
+{
+  if [ "$2" != "$3" ]; then
+    echo "FAIL $1: $2 unchanged TUs, expected $3"
+    exit 1
+  fi
+}
+
+check "first batch" "$(batch)" 0
+check "nothing edited" "$(batch)" 1
+echo "int inc2(void);" >> "$top/build/inc.h"
+check "header edited" "$(batch)" 0
+check "nothing edited again" "$(batch)" 1
+echo PASS
@@ -0,0 +1,190 @@
+// Checks SyntaxScanner and the interval codec against plain implementations:
+// the SSE2 scanner finds the same intervals as the scalar one, on the given
+// files and on random text, and IntervalWriter, IntervalReader and
+// intersectIntervals() agree with sets of offsets.
+//
+//   ninja scanner_test.out && ./scanner_test.out testdata/syntax.c testdata/*.cc
+#include "../build/record.pb.h"
+
+#include "llvm/ADT/StringRef.h"
+
+#include <boost/noncopyable.hpp>
+
+#include <algorithm>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <assert.h>
+#include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace indexer
+{
+#include "../intervals.h"
+#include "../scanner.h"
+}
+
+#ifdef __SSE2__
+// the same scanner again, without SSE2
+#undef __SSE2__
+namespace scalar
+{
+using indexer::IntervalWriter;
+namespace proto = indexer::proto;
+#include "../scanner.h"
+}
+#define HAVE_SCALAR 1
+#endif
+
+using indexer::IntervalReader;
+using indexer::IntervalWriter;
+using indexer::proto::Intervals;
+using indexer::proto::Syntax;
+
+int failures = 0;
+
+void check(bool ok, const char* what, const std::string& name)
+{
+  if (!ok)
+  {
+    fprintf(stderr, "FAIL %s %s\n", what, name.c_str());
+    ++failures;
+  }
+}
+
+std::vector<std::pair<uint32_t, uint32_t>> decode(const Intervals& intervals)
+{
+  std::vector<std::pair<uint32_t, uint32_t>> result;
+  indexer::forEachInterval(intervals, [&result](uint32_t begin, uint32_t end) {
+    result.push_back(std::make_pair(begin, end));
+  });
+  return result;
+}
+
+void checkScanner(llvm::StringRef text, const std::string& name)
+{
+  Syntax simd;
+  indexer::SyntaxScanner(text).scan(&simd);
+  for (const auto& decl : simd.declarators())
+  {
+    uint32_t last = 0;
+    bool ordered = true;
+    for (const auto& interval : decode(decl.intervals()))
+    {
+      ordered = ordered && interval.first >= last && interval.second > interval.first
+                && interval.second <= text.size();
+      last = interval.second;
+    }
+    check(ordered, "disjoint intervals", name);
+  }
+#ifdef HAVE_SCALAR
+  Syntax plain;
+  scalar::SyntaxScanner(text).scan(&plain);
+  check(simd.SerializeAsString() == plain.SerializeAsString(), "SSE2 != scalar", name);
+#endif
+}
+
+// random text of characters the scanner cares about, so literals, comments
+// and numbers cross 16-byte blocks and the end of text
+std::string randomText(std::mt19937* gen)
+{
+  static const char kChars[] = "/*'\"\\\n .0123456789eEpP+-xXuUlLfF_abz\t#";
+  std::uniform_int_distribution<int> length(0, 200);
+  std::uniform_int_distribution<int> pick(0, sizeof kChars - 2);
+  std::string text(length(*gen), ' ');
+  for (char& ch : text)
+  {
+    ch = kChars[pick(*gen)];
+  }
+  return text;
+}
+
+// sorted, disjoint and non-adjacent, as IntervalWriter merges adjacent ones
+std::vector<std::pair<uint32_t, uint32_t>> randomIntervals(std::mt19937* gen)
+{
+  std::uniform_int_distribution<int> count(0, 20);
+  std::uniform_int_distribution<uint32_t> gap(1, 300), size(1, 300);
+  std::vector<std::pair<uint32_t, uint32_t>> result;
+  uint32_t end = 0;
+  for (int n = count(*gen); n > 0; --n)
+  {
+    uint32_t begin = end + gap(*gen);
+    end = begin + size(*gen);
+    result.push_back(std::make_pair(begin, end));
+  }
+  return result;
+}
+
+Intervals encode(const std::vector<std::pair<uint32_t, uint32_t>>& intervals)
+{
+  Intervals result;
+  IntervalWriter writer(&result);
+  for (const auto& interval : intervals)
+  {
+    writer.add(interval.first, interval.second);
+  }
+  return result;
+}
+
+std::vector<bool> offsets(const std::vector<std::pair<uint32_t, uint32_t>>& intervals)
+{
+  std::vector<bool> result(8192);
+  for (const auto& interval : intervals)
+  {
+    std::fill(result.begin() + interval.first, result.begin() + interval.second, true);
+  }
+  return result;
+}
+
+void checkIntervals(std::mt19937* gen)
+{
+  auto lhs = randomIntervals(gen), rhs = randomIntervals(gen);
+  Intervals left = encode(lhs), right = encode(rhs);
+  check(decode(left) == lhs, "interval round trip", "");
+
+  std::vector<bool> expected = offsets(lhs), other = offsets(rhs);
+  for (size_t i = 0; i < expected.size(); ++i)
+  {
+    expected[i] = expected[i] && other[i];
+  }
+  Intervals both;
+  indexer::intersectIntervals(left, right, &both);
+  check(offsets(decode(both)) == expected, "intersectIntervals", "");
+  // in place, as Joiner::intersectSkipped() does
+  indexer::intersectIntervals(left, right, &left);
+  check(left.SerializeAsString() == both.SerializeAsString(), "intersectIntervals in place", "");
+}
+
+int main(int argc, char* argv[])
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    FILE* fp = ::fopen(argv[i], "rb");
+    if (fp == nullptr)
+    {
+      perror(argv[i]);
+      return 1;
+    }
+    std::string content;
+    char buf[8192];
+    size_t n = 0;
+    while ((n = ::fread(buf, 1, sizeof buf, fp)) > 0)
+    {
+      content.append(buf, n);
+    }
+    ::fclose(fp);
+    checkScanner(content, argv[i]);
+  }
+
+  std::mt19937 gen(42);
+  for (int i = 0; i < 10000; ++i)
+  {
+    checkScanner(randomText(&gen), "random text " + std::to_string(i));
+    checkIntervals(&gen);
+  }
+  printf("%s, %d failures\n", failures == 0 ? "PASS" : "FAIL", failures);
+  return failures == 0 ? 0 : 1;
+}
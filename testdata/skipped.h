@@ -0,0 +1,20 @@
+// included twice by syntax.c, each inclusion skips one branch, so neither
+// branch is dead in that TU, see skipped_test.cc
+#ifdef FIRST
+int first_inclusion(void);
+#else
+int second_inclusion(void);
+#endif
+
+#if 0
+int never_compiled(void);
+#if 1
+int nested_in_skipped(void);
+#endif
+#endif
+
+#if 1
+#if 0
+int skipped_in_compiled(void);
+#endif
+#endif
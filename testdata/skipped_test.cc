@@ -0,0 +1,141 @@
+// Checks lines skipped by #if, recorded by IndexPP in "prep:" records:
+// directive lines are not skipped, a nested #if is skipped with its
+// enclosing block, and lines of a header are skipped only if skipped in
+// every inclusion, as syntax.c includes skipped.h twice under different
+// macros.
+//
+//   ninja a.out skipped_test.out && ./a.out testdata/syntax.c
+//   ./skipped_test.out tmp/testdata_syntax.c.cindex
+#include "leveldb/db.h"
+#include "llvm/Support/MD5.h"
+#include "../build/record.pb.h"
+
+#include <boost/noncopyable.hpp>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+
+using std::string;
+#include "../sink.h"
+
+namespace indexer
+{
+#include "../intervals.h"
+#include "../linetable.h"
+}
+
+using indexer::proto::Declarator;
+using indexer::proto::Preprocess;
+
+int failures = 0;
+
+void check(bool ok, const char* what, const string& name)
+{
+  if (!ok)
+  {
+    fprintf(stderr, "FAIL %s %s\n", what, name.c_str());
+    ++failures;
+  }
+}
+
+bool readFile(const string& path, string* content)
+{
+  FILE* fp = ::fopen(path.c_str(), "rb");
+  if (fp == nullptr)
+  {
+    perror(path.c_str());
+    return false;
+  }
+  char buf[8192];
+  size_t n = 0;
+  while ((n = ::fread(buf, 1, sizeof buf, fp)) > 0)
+  {
+    content->append(buf, n);
+  }
+  ::fclose(fp);
+  return true;
+}
+
+// 1-based lines of SKIPPED intervals of pp, whose file is read from cwd
+std::set<unsigned> skippedLines(const Preprocess& pp)
+{
+  std::set<unsigned> lines;
+  string content;
+  if (!readFile(pp.filename(), &content))
+  {
+    check(false, "read", pp.filename());
+    return lines;
+  }
+  indexer::LineTable table(content);
+  for (const auto& decl : pp.declarators())
+  {
+    if (decl.type() != Declarator::SKIPPED)
+      continue;
+    indexer::forEachInterval(decl.intervals(), [&](uint32_t begin, uint32_t end) {
+      // whole lines, from the line after #if to the line before #endif
+      check(begin == 0 || content[begin - 1] == '\n', "interval begins a line", pp.filename());
+      check(end == content.size() || content[end - 1] == '\n', "interval ends a line",
+            pp.filename());
+      for (unsigned line = table.line(begin); line <= table.line(end - 1); ++line)
+      {
+        lines.insert(line);
+      }
+    });
+  }
+  return lines;
+}
+
+std::set<unsigned> range(unsigned first, unsigned last)
+{
+  std::set<unsigned> lines;
+  for (unsigned line = first; line <= last; ++line)
+  {
+    lines.insert(line);
+  }
+  return lines;
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "Usage: %s tmp/testdata_syntax.c.cindex\n", argv[0]);
+    return 1;
+  }
+
+  std::map<string, std::set<unsigned>> expected;
+  // #if 0 ... #elif ... #else skips both branches and the #elif between them
+  expected["testdata/syntax.c"] = range(22, 24);
+  // #ifdef FIRST ... #else ... is compiled by one of the two inclusions,
+  // #if 1 nested in #if 0 is skipped with it, #if 0 nested in #if 1 alone
+  std::set<unsigned> header = range(10, 13);
+  header.insert(18);
+  expected["testdata/skipped.h"] = header;
+
+  Reader reader(argv[1]);
+  check(reader.valid(), "open", argv[1]);
+  string key, value;
+  std::set<string> found;
+  while (reader.read(&key, &value))
+  {
+    Preprocess pp;
+    if (!leveldb::Slice(key).starts_with("prep:") || !pp.ParseFromString(value))
+      continue;
+    auto it = expected.find(pp.filename());
+    if (it == expected.end())
+      continue;
+    found.insert(it->first);
+    check(skippedLines(pp) == it->second, "skipped lines", it->first);
+  }
+  for (const auto& it : expected)
+  {
+    check(found.count(it.first) > 0, "no prep: record", it.first);
+  }
+  printf("%s, %d failures\n", failures == 0 ? "PASS" : "FAIL", failures);
+  return failures == 0 ? 0 : 1;
+}
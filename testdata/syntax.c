@@ -0,0 +1,27 @@
+// Comments, literals and numbers which span or end at a 16-byte boundary,
+// see scanner_test.cc, and lines skipped by #if, see skipped.h.
+#define FIRST
+#include "skipped.h"
+#undef FIRST
+#include "skipped.h"
+
+/* a block comment longer than sixteen bytes, with a * and a / inside */
+const char* s1 = "a string literal longer than 16 bytes \" with a quote";
+const char* s2 = "ends with a backslash \\";
+const char* s3 = "continued \
+on the next line";
+char c1 = '\'';
+char c2 = '"';
+int u32 = 0x1fUL + 017 + 1e10 + .5e-3 + 1.5f + 0x1p-3 + 'ab';
+int x__123456789012345678 = 12345678901234567;  // digits in an identifier
+// a line comment continued \
+on the next line
+/**/ int after_empty_comment = 2 / 1;
+
+#if 0
+int skipped_in_every_inclusion(void);
+#elif defined(FIRST)
+int skipped_too(void);
+#else
+int compiled(void);
+#endif
@@ -1,5 +1,5 @@
 
-struct Util
+struct Util : boost::noncopyable
 {
   const clang::SourceManager& sourceManager_;
   const clang::LangOptions& langOpts_;
@@ -12,7 +12,7 @@ struct Util
   string filePathOrDie(clang::FileID fileId) const
   {
     if (const clang::FileEntry* fileEntry = sourceManager_.getFileEntryForID(fileId))
-      return fileEntry->getName();
+      return CanonicalPaths::get(sourceManager_, fileEntry);
     else
       assert(0 && "Cannot getFileEntryForID()");
   }
@@ -28,12 +28,40 @@ struct Util
   {
     assert(sloc.isFileID());
     auto decomposed = sourceManager_.getDecomposedLoc(sloc);
+    LineTable& table = lineTable(decomposed.first);
+    unsigned lineno = table.line(decomposed.second);
     loc->set_offset(decomposed.second);
-    bool invalid = true;
-    loc->set_lineno(sourceManager_.getLineNumber(decomposed.first, decomposed.second, &invalid));
-    assert(!invalid && "getLineNumber");
-    loc->set_column(sourceManager_.getColumnNumber(decomposed.first, decomposed.second, &invalid));
-    assert(!invalid && "getColumnNumber");
+    loc->set_lineno(lineno);
+    loc->set_column(table.column(decomposed.second, lineno));
+  }
+
+  // built once per file of a TU
+  LineTable& lineTable(clang::FileID fileId) const
+  {
+    if (lastTable_ && fileId == lastFileId_)
+      return *lastTable_;
+    auto it = lineTables_.find(fileId.getHashValue());
+    if (it == lineTables_.end())
+    {
+      bool invalid = false;
+      llvm::StringRef buffer = sourceManager_.getBufferData(fileId, &invalid);
+      assert(!invalid && "getBufferData");
+      it = lineTables_.insert(std::make_pair(fileId.getHashValue(), LineTable(buffer))).first;
+    }
+    lastFileId_ = fileId;
+    lastTable_ = &it->second;
+    return it->second;
+  }
+
+  // true if the token at start is spelled as name, without lexing it again
+  bool isSpelled(clang::SourceLocation start, const string& name) const
+  {
+    bool invalid = false;
+    const char* data = sourceManager_.getCharacterData(start, &invalid);
+    // buffers are null terminated, so strncmp() stops at the end
+    return !invalid && !name.empty()
+        && ::strncmp(data, name.c_str(), name.size()) == 0
+        && !clang::isIdentifierBody(data[name.size()], langOpts_.DollarIdents);
   }
 
   string getSpelling(clang::SourceLocation start) const
@@ -48,6 +76,14 @@ struct Util
     assert(start.isValid());
     if (start.isFileID())
     {
+      if (isSpelled(start, name))
+      {
+        sourceLocationToLocation(start, range->mutable_begin());
+        sourceLocationToLocation(start.getLocWithOffset(name.size()), range->mutable_end());
+        return true;
+      }
+
+      // eg. an escaped newline in the token
       string spelling = getSpelling(start);
       if (!name.empty() && spelling != name)
       {
@@ -65,8 +101,7 @@ struct Util
     else
     {
       clang::SourceLocation fileLoc = sourceManager_.getFileLoc(start);
-      string spelling = getSpelling(fileLoc);
-      if (spelling == name)
+      if (isSpelled(fileLoc, name) || getSpelling(fileLoc) == name)
       {
         // asm-generic/io.h:
         // #define readb readb
@@ -92,6 +127,11 @@ struct Util
     }
   }
 
+  // key is FileID
+  mutable std::unordered_map<unsigned, LineTable> lineTables_;
+  mutable clang::FileID lastFileId_;
+  mutable LineTable* lastTable_ = nullptr;
+
   static proto::StorageClass toProto(clang::StorageClass sc)
   {
     switch (sc)